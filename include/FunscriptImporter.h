@@ -0,0 +1,503 @@
+#pragma once
+#include <Arduino.h>
+#include <FS.h>
+#include <ArduinoJson.h>
+#include "KeyframeDecimator.h"
+
+#define IMPORT_RUN_ACTIONS 256 // actions sorted in RAM at a time
+#define IMPORT_MAX_RUNS 16 // sorted runs merged per pass
+#define IMPORT_MERGE_BUFFER (IMPORT_RUN_ACTIONS / IMPORT_MAX_RUNS) // actions buffered per run while merging
+#define IMPORT_SCRATCH_A "/import.a"
+#define IMPORT_SCRATCH_B "/import.b"
+#define IMPORT_TMP "/import.tmp"
+#define IMPORT_JOURNAL "/import.job" // path of the file IMPORT_TMP is replacing
+#define IMPORT_MAX_PATH 64
+#define IMPORT_MIN_DECIMATED 10 // % of actions decimation must remove to rewrite an otherwise clean file
+#define IMPORT_MIN_DECIMATED_ACTIONS 32 // and at least this many, small files are not worth a rewrite
+#define IMPORT_MARKER "{\"imported\":true," // starts files written by the importer
+#define IMPORT_HEADER IMPORT_MARKER "\"actions\":["
+
+enum ImportRepair {
+    REPAIR_NONE,
+    REPAIR_DECIMATE, // clean, but over-dense
+    REPAIR_SORT      // unsorted, duplicate or out of range actions
+};
+
+/**
+ * Normalizes funscript files so playback can assume clean actions:
+ * sorted by "at", one action per timestamp (the last one in the file wins),
+ * no negative times, and positions within 0 to 100. Over-dense actions are
+ * decimated within DECIMATE_TOLERANCE.
+ *
+ * Files with unsorted, duplicate or out of range actions are sorted with an
+ * external merge sort, using a fixed RAM scratch area and scratch files on
+ * flash, and rewritten in place as a minimal funscript. Other funscript
+ * properties are not kept. Files that are already clean are only rewritten
+ * if decimation removes at least IMPORT_MIN_DECIMATED percent of the
+ * actions, and IMPORT_MIN_DECIMATED_ACTIONS of them. They are streamed through the decimator without sorting, keeping
+ * the other properties, and if that fails the original is played as is.
+ * Rewritten files start with IMPORT_MARKER and are skipped on later imports,
+ * so decimation error does not accumulate.
+ *
+ * The repaired file only replaces the original once it is complete, and the
+ * replacement is journaled. If power is lost or the rename fails partway,
+ * recover() finishes it on the next boot.
+ */
+class FunscriptImporter {
+    public:
+        FunscriptImporter() {
+            jsonFilter["at"] = true;
+            jsonFilter["pos"] = true;
+        }
+        bool import(fs::FS &fs, const char *path);
+        void recover(fs::FS &fs);
+
+    private:
+        fs::FS *importFs = NULL;
+        File input;
+        File output;
+        bool endOfActions = false;
+        bool parseError = false;
+        bool writeError = false;
+        bool outputJson = false; // final merge writes the funscript, otherwise binary runs
+        bool havePending = false;
+        FunscriptAction pending; // last action merged, held back until its timestamp is complete
+        uint32_t actionsWritten = 0;
+
+        StaticJsonDocument<64> jsonFilter;
+        StaticJsonDocument<64> actionJson;
+        KeyframeDecimator decimator;
+
+        // Sorting and merging are separate phases, so they share one scratch area
+        union {
+            FunscriptAction run[IMPORT_RUN_ACTIONS];
+            FunscriptAction merge[IMPORT_MAX_RUNS][IMPORT_MERGE_BUFFER];
+        } scratch;
+        uint32_t runNext[IMPORT_MAX_RUNS]; // next action to load from each run
+        uint32_t runEnd[IMPORT_MAX_RUNS];
+        uint8_t bufPos[IMPORT_MAX_RUNS];
+        uint8_t bufLen[IMPORT_MAX_RUNS];
+
+        bool openActions(const char *path);
+        bool isImported();
+        bool readAction(FunscriptAction &a);
+        ImportRepair checkFile(const char *path);
+        bool decimateFile(const char *path);
+        void copyBytes(size_t end);
+        uint32_t writeRuns(const char *path, const char *runPath);
+        bool mergeRuns(File &in, uint32_t first, uint32_t runLen, uint32_t total);
+        bool fillBuffer(File &in, int r);
+        void writeAction(const FunscriptAction &a);
+        void writePending();
+        void writeJsonAction(const FunscriptAction &a);
+        void writeBytes(const void *data, size_t len);
+        void flushActions();
+        void finishOutput();
+        bool replaceFile(const char *path);
+        void cleanup(bool keepTmp = false);
+};
+
+/**
+ * Check a file and rewrite it in place if it needs repair.
+ * Returns false if the file could not be read or repaired, and should not be played.
+ */
+bool FunscriptImporter::import(fs::FS &fs, const char *path)
+{
+    importFs = &fs;
+    ImportRepair repair = checkFile(path);
+    if (parseError) return false;
+    if (repair == REPAIR_NONE) return true;
+    if (fs.exists(IMPORT_JOURNAL)) {
+        Serial.printf("Not repairing %s: an earlier repair is still waiting to be recovered\n", path);
+        return repair == REPAIR_DECIMATE;
+    }
+    if (repair == REPAIR_DECIMATE) return decimateFile(path);
+
+    Serial.printf("Repairing file: %s\n", path);
+
+    uint32_t total = writeRuns(path, IMPORT_SCRATCH_A);
+    if (parseError || writeError || total == 0) {
+        Serial.println("- failed to sort actions");
+        cleanup();
+        return false;
+    }
+
+    // Merge groups of runs until a single pass can merge the rest
+    const char *src = IMPORT_SCRATCH_A;
+    const char *dst = IMPORT_SCRATCH_B;
+    uint32_t runLen = IMPORT_RUN_ACTIONS;
+    outputJson = false;
+    while (!writeError && (total + runLen - 1) / runLen > IMPORT_MAX_RUNS) {
+        File in = fs.open(src);
+        output = fs.open(dst, FILE_WRITE);
+        for (uint32_t first = 0; first < total && !writeError; first += runLen * IMPORT_MAX_RUNS) {
+            mergeRuns(in, first, runLen, total);
+        }
+        in.close();
+        output.close();
+        runLen *= IMPORT_MAX_RUNS;
+        const char *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    // Final merge writes the funscript, dropping duplicate timestamps
+    File in = fs.open(src);
+    output = fs.open(IMPORT_TMP, FILE_WRITE);
+    outputJson = true;
+    havePending = false;
+    actionsWritten = 0;
+    decimator.reset();
+    writeBytes(IMPORT_HEADER, strlen(IMPORT_HEADER));
+    mergeRuns(in, 0, runLen, total);
+    finishOutput();
+    in.close();
+    output.close();
+
+    if (writeError) {
+        Serial.println("- failed to write repaired file (flash full?)");
+        cleanup();
+        return false;
+    }
+    if (!replaceFile(path)) {
+        return false;
+    }
+    cleanup();
+    Serial.printf("- %u actions sorted, %u kept (%u%% fewer), max deviation %.2f\n",
+        (unsigned)total,
+        (unsigned)actionsWritten,
+        (unsigned)(100 - actionsWritten * 100 / total),
+        decimator.maxDeviation
+    );
+    return true;
+}
+
+bool FunscriptImporter::openActions(const char *path)
+{
+    input = importFs->open(path);
+    endOfActions = false;
+    parseError = false;
+    if (!input || input.isDirectory() || !input.find("\"actions\":[")) {
+        Serial.printf("- failed to find Funscript actions: %s\n", path);
+        input.close();
+        parseError = true;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Read the next action from the open file. Returns false at the end of the actions.
+ */
+bool FunscriptImporter::readAction(FunscriptAction &a)
+{
+    while (!endOfActions) {
+        DeserializationError error = deserializeJson(actionJson, input, DeserializationOption::Filter(jsonFilter));
+        endOfActions = !input.findUntil(",", "]");
+        if (error == DeserializationError::Ok) {
+            a.at = actionJson["at"].as<int>();
+            a.pos = actionJson["pos"].as<short>();
+            return true;
+        } else if (error != DeserializationError::EmptyInput) {
+            Serial.println(error.c_str());
+            parseError = true;
+            endOfActions = true;
+        }
+    }
+    return false;
+}
+
+bool FunscriptImporter::isImported()
+{
+    size_t actionsPos = input.position();
+    char header[sizeof(IMPORT_MARKER) - 1];
+    input.seek(0);
+    bool imported = input.read((uint8_t*)header, sizeof(header)) == sizeof(header)
+        && memcmp(header, IMPORT_MARKER, sizeof(header)) == 0;
+    input.seek(actionsPos);
+    return imported;
+}
+
+/**
+ * Single read-only pass to find unsorted, duplicate or out of range actions,
+ * or enough actions that decimation would remove.
+ */
+ImportRepair FunscriptImporter::checkFile(const char *path)
+{
+    if (!openActions(path)) return REPAIR_NONE;
+    if (isImported()) {
+        input.close();
+        return REPAIR_NONE;
+    }
+
+    FunscriptAction a, kept;
+    int32_t lastAt = -1;
+    bool repair = false;
+    decimator.reset();
+    while (!repair && readAction(a)) {
+        repair = (a.at <= lastAt || a.pos < 0 || a.pos > 100);
+        lastAt = a.at;
+        decimator.push(a, kept);
+    }
+    decimator.finish(kept);
+    input.close();
+    if (parseError) return REPAIR_NONE;
+    if (repair) return REPAIR_SORT;
+    uint32_t removed = decimator.actionsIn - decimator.actionsKept;
+    bool worthIt = removed >= IMPORT_MIN_DECIMATED_ACTIONS && removed * 100 >= decimator.actionsIn * IMPORT_MIN_DECIMATED;
+    return worthIt ? REPAIR_DECIMATE : REPAIR_NONE;
+}
+
+/**
+ * Rewrite a clean file with its actions decimated, in one streaming pass
+ * that keeps everything around the actions. Decimation is optional, so if it
+ * fails the original is kept and played. Returns false only if the original
+ * was already removed and is waiting for recover().
+ */
+bool FunscriptImporter::decimateFile(const char *path)
+{
+    Serial.printf("Decimating file: %s\n", path);
+    if (!openActions(path)) return false;
+    size_t actionsStart = input.position();
+    output = importFs->open(IMPORT_TMP, FILE_WRITE);
+    writeError = !output;
+
+    // Everything before the actions, marked as imported
+    input.seek(0);
+    int c;
+    while ((c = input.read()) >= 0 && c != '{');
+    writeBytes(IMPORT_MARKER, strlen(IMPORT_MARKER));
+    copyBytes(actionsStart);
+
+    FunscriptAction a;
+    outputJson = true;
+    havePending = false;
+    actionsWritten = 0;
+    decimator.reset();
+    while (!writeError && readAction(a)) {
+        writeAction(a);
+    }
+    flushActions();
+    writeBytes("]", 1);
+    copyBytes(input.size()); // everything after the actions
+    input.close();
+    output.close();
+
+    if (writeError || parseError) {
+        Serial.println("- failed to write decimated file (flash full?), playing the original");
+        cleanup();
+        return true;
+    }
+    if (!replaceFile(path)) {
+        return importFs->exists(path);
+    }
+    cleanup();
+    Serial.printf("- %u actions, %u kept (%u%% fewer), max deviation %.2f\n",
+        (unsigned)decimator.actionsIn,
+        (unsigned)actionsWritten,
+        (unsigned)(100 - actionsWritten * 100 / decimator.actionsIn),
+        decimator.maxDeviation
+    );
+    return true;
+}
+
+/**
+ * Copy the input up to position end to the output, through the scratch area.
+ */
+void FunscriptImporter::copyBytes(size_t end)
+{
+    uint8_t *buf = (uint8_t*)scratch.run;
+    while (!writeError && input.position() < end) {
+        size_t n = input.read(buf, min(end - input.position(), sizeof(scratch.run)));
+        if (n == 0) break;
+        writeBytes(buf, n);
+    }
+}
+
+/**
+ * Split the actions into sorted runs of IMPORT_RUN_ACTIONS, written to flash.
+ * Returns the number of actions written.
+ */
+uint32_t FunscriptImporter::writeRuns(const char *path, const char *runPath)
+{
+    if (!openActions(path)) return 0;
+    output = importFs->open(runPath, FILE_WRITE);
+    writeError = !output;
+    outputJson = false;
+
+    uint32_t total = 0;
+    FunscriptAction a;
+    bool more = true;
+    while (more && !writeError) {
+        int n = 0;
+        while (n < IMPORT_RUN_ACTIONS && (more = readAction(a))) {
+            if (a.at < 0) continue; // nothing can be played before the start
+            a.pos = min(max(a.pos, (int16_t)0), (int16_t)100);
+
+            // Insertion sort keeps equal timestamps in file order
+            int i = n++;
+            while (i > 0 && scratch.run[i - 1].at > a.at) {
+                scratch.run[i] = scratch.run[i - 1];
+                i--;
+            }
+            scratch.run[i] = a;
+        }
+        writeBytes(scratch.run, n * sizeof(FunscriptAction));
+        total += n;
+    }
+    input.close();
+    output.close();
+    return total;
+}
+
+/**
+ * Merge up to IMPORT_MAX_RUNS consecutive runs of runLen actions, starting
+ * at action index first, into the output. Ties go to the earlier run, so
+ * equal timestamps stay in file order.
+ */
+bool FunscriptImporter::mergeRuns(File &in, uint32_t first, uint32_t runLen, uint32_t total)
+{
+    int runs = 0;
+    for (uint32_t start = first; start < total && runs < IMPORT_MAX_RUNS; start += runLen) {
+        runNext[runs] = start;
+        runEnd[runs] = min(start + runLen, total);
+        fillBuffer(in, runs++);
+    }
+
+    for (;;) {
+        int best = -1;
+        for (int r = 0; r < runs; r++) {
+            if (bufPos[r] >= bufLen[r] && !fillBuffer(in, r)) continue;
+            if (best < 0 || scratch.merge[r][bufPos[r]].at < scratch.merge[best][bufPos[best]].at) {
+                best = r;
+            }
+        }
+        if (best < 0 || writeError) break;
+        writeAction(scratch.merge[best][bufPos[best]++]);
+    }
+    return !writeError;
+}
+
+bool FunscriptImporter::fillBuffer(File &in, int r)
+{
+    uint32_t n = min(runEnd[r] - runNext[r], (uint32_t)IMPORT_MERGE_BUFFER);
+    bufPos[r] = 0;
+    bufLen[r] = 0;
+    if (n == 0) return false;
+    in.seek(runNext[r] * sizeof(FunscriptAction));
+    bufLen[r] = in.read((uint8_t*)scratch.merge[r], n * sizeof(FunscriptAction)) / sizeof(FunscriptAction);
+    runNext[r] += n;
+    return bufLen[r] > 0;
+}
+
+void FunscriptImporter::writeAction(const FunscriptAction &a)
+{
+    if (!outputJson) {
+        writeBytes(&a, sizeof(a));
+        return;
+    }
+    // Keep the last action for each timestamp
+    if (havePending && pending.at != a.at) {
+        writePending();
+    }
+    pending = a;
+    havePending = true;
+}
+
+void FunscriptImporter::writePending()
+{
+    FunscriptAction kept;
+    if (decimator.push(pending, kept)) writeJsonAction(kept);
+}
+
+void FunscriptImporter::writeJsonAction(const FunscriptAction &a)
+{
+    char buf[40];
+    int len = snprintf(buf, sizeof(buf), "%s{\"at\":%d,\"pos\":%d}",
+        actionsWritten > 0 ? "," : "", (int)a.at, (int)a.pos);
+    writeBytes(buf, len);
+    actionsWritten++;
+}
+
+void FunscriptImporter::writeBytes(const void *data, size_t len)
+{
+    if (writeError || len == 0) return;
+    writeError = (output.write((const uint8_t*)data, len) != len);
+}
+
+void FunscriptImporter::flushActions()
+{
+    if (havePending) writePending();
+    havePending = false;
+    FunscriptAction kept;
+    if (decimator.finish(kept)) writeJsonAction(kept);
+}
+
+void FunscriptImporter::finishOutput()
+{
+    flushActions();
+    writeBytes("]}", 2);
+}
+
+/**
+ * Replace the original file with the completed IMPORT_TMP, journaling the
+ * path first so an interrupted replacement can be recovered.
+ */
+bool FunscriptImporter::replaceFile(const char *path)
+{
+    File journal = importFs->open(IMPORT_JOURNAL, FILE_WRITE);
+    bool journaled = journal && journal.write((const uint8_t*)path, strlen(path)) == strlen(path);
+    journal.close();
+    if (!journaled) {
+        Serial.println("- failed to write import journal (flash full?)");
+        importFs->remove(IMPORT_JOURNAL);
+        cleanup();
+        return false;
+    }
+
+    importFs->remove(path);
+    if (!importFs->rename(IMPORT_TMP, path)) {
+        Serial.printf("- failed to replace file, keeping %s to recover on the next boot\n", IMPORT_TMP);
+        cleanup(true);
+        return false;
+    }
+    importFs->remove(IMPORT_JOURNAL);
+    return true;
+}
+
+/**
+ * Finish a replacement interrupted by power loss or a failed rename.
+ * Call at boot, before listing the files.
+ */
+void FunscriptImporter::recover(fs::FS &fs)
+{
+    importFs = &fs;
+    char path[IMPORT_MAX_PATH] = "";
+    File journal = fs.open(IMPORT_JOURNAL);
+    if (journal) {
+        path[journal.read((uint8_t*)path, sizeof(path) - 1)] = '\0';
+        journal.close();
+    }
+
+    if (path[0] && fs.exists(IMPORT_TMP)) {
+        Serial.printf("Recovering repaired file: %s\n", path);
+        fs.remove(path);
+        if (!fs.rename(IMPORT_TMP, path)) {
+            Serial.println("- failed, will retry on the next boot");
+            return;
+        }
+    }
+    // Otherwise the journal was left after the rename, or an import never finished writing
+    if (fs.exists(IMPORT_JOURNAL)) fs.remove(IMPORT_JOURNAL);
+    cleanup();
+}
+
+void FunscriptImporter::cleanup(bool keepTmp)
+{
+    const char *paths[] = { IMPORT_SCRATCH_A, IMPORT_SCRATCH_B, IMPORT_TMP };
+    for (const char *p : paths) {
+        if (keepTmp && p == paths[2]) continue;
+        if (importFs->exists(p)) importFs->remove(p);
+    }
+    writeError = false;
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include <Arduino.h>
+
+#define DECIMATE_TOLERANCE 1.0 // max position error of a removed action (0 to 100 scale)
+#define DECIMATE_WINDOW 32 // max actions removed between two kept actions
+
+struct FunscriptAction {
+    int32_t at;
+    int16_t pos;
+};
+
+/**
+ * Streaming, error-bounded simplification of sorted actions.
+ *
+ * An action is removed when the straight line between the kept actions on
+ * either side passes within tolerance of it at its time, which is how
+ * playback interpolates. Only a window of pending actions is held, so it
+ * runs in constant memory on any file length.
+ */
+class KeyframeDecimator {
+    public:
+        KeyframeDecimator(float tolerance = DECIMATE_TOLERANCE) : tolerance(tolerance) {}
+        void reset();
+        bool push(const FunscriptAction &a, FunscriptAction &kept);
+        bool finish(FunscriptAction &kept);
+
+        uint32_t actionsIn = 0;
+        uint32_t actionsKept = 0;
+        float maxDeviation = 0; // largest error of any removed action
+
+    private:
+        float tolerance;
+        bool haveAnchor = false;
+        FunscriptAction anchor; // last kept action
+        FunscriptAction window[DECIMATE_WINDOW]; // actions after the anchor, the last one is the line's end
+        int windowLen = 0;
+        float windowDeviation = 0; // error of the actions between the anchor and the window end
+
+        bool fits(const FunscriptAction &end, float &deviation);
+        void keep(FunscriptAction &kept);
+};
+
+void KeyframeDecimator::reset()
+{
+    haveAnchor = false;
+    windowLen = 0;
+    windowDeviation = 0;
+    actionsIn = 0;
+    actionsKept = 0;
+    maxDeviation = 0;
+}
+
+/**
+ * Add the next action. Returns true with an action to keep when one is final.
+ */
+bool KeyframeDecimator::push(const FunscriptAction &a, FunscriptAction &kept)
+{
+    actionsIn++;
+    if (!haveAnchor) {
+        haveAnchor = true;
+        anchor = a;
+        kept = a;
+        actionsKept++;
+        return true;
+    }
+
+    float deviation;
+    if (windowLen == 0 || (windowLen < DECIMATE_WINDOW && fits(a, deviation))) {
+        if (windowLen > 0) windowDeviation = deviation;
+        window[windowLen++] = a;
+        return false;
+    }
+
+    // The line can't reach this action, keep the last end point
+    keep(kept);
+    window[0] = a;
+    windowLen = 1;
+    return true;
+}
+
+/**
+ * Flush the last action at the end of the input.
+ */
+bool KeyframeDecimator::finish(FunscriptAction &kept)
+{
+    if (windowLen == 0) return false;
+    keep(kept);
+    windowLen = 0;
+    return true;
+}
+
+/**
+ * Check that every action in the window is within tolerance of the line
+ * from the anchor to end.
+ */
+bool KeyframeDecimator::fits(const FunscriptAction &end, float &deviation)
+{
+    float slope = float(end.pos - anchor.pos) / (end.at - anchor.at);
+    deviation = 0;
+    for (int i = 0; i < windowLen; i++) {
+        float lerp = anchor.pos + slope * (window[i].at - anchor.at);
+        deviation = max(deviation, fabsf(lerp - window[i].pos));
+        if (deviation > tolerance) return false;
+    }
+    return true;
+}
+
+void KeyframeDecimator::keep(FunscriptAction &kept)
+{
+    anchor = window[windowLen - 1];
+    kept = anchor;
+    actionsKept++;
+    maxDeviation = max(maxDeviation, windowDeviation);
+    windowDeviation = 0;
+}
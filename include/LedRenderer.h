@@ -0,0 +1,197 @@
+#pragma once
+#include <Arduino.h>
+#include "nimbleConModule.h"
+
+#define LED_CHANNELS 12 // ENC_LED_E to WIFI_LED
+#define LED_FRAME_MS 30 // render interval
+#define LED_HARDWARE_DUTY 50 // actuator and pendant presence LEDs
+
+enum LedMode {
+    LED_MODE_POSITION,  // actuator position and vibration
+    LED_MODE_INTENSITY, // stroke speed of the upcoming keyframes
+    LED_MODE_BUFFER,    // keyframe buffer fill
+    LED_MODE_PROGRESS,  // playback progress through the current file
+    LED_MODE_COUNT
+};
+
+/**
+ * Player state shown on the LEDs, published from the control loop.
+ */
+struct LedState {
+    int16_t position = 0; // last position sent (-ACTUATOR_MAX_POS to ACTUATOR_MAX_POS)
+    int16_t vibrationPos = 0;
+    uint16_t vibrationMax = 0; // 0 when vibration is compiled out
+    uint8_t intensity = 0; // 0 to 255
+    uint8_t bufferLevel = 0; // 0 to 255
+    uint8_t progress = 0; // 0 to 255
+    bool actuatorPresent = false;
+    bool pendantPresent = false;
+};
+
+/**
+ * Double-buffered LED renderer.
+ *
+ * The control loop only copies a LedState in with publish(). A task on the
+ * other core draws each frame into a back buffer and writes just the
+ * channels that differ from what was last written.
+ */
+class LedRenderer {
+    public:
+        void init();
+        void publish(const LedState &s);
+        void setMode(LedMode m) { mode = m; }
+        LedMode getMode() { return mode; }
+        void nextMode(int step = 1);
+        void renderFrame();
+        void printStats(Print &out = Serial);
+        uint32_t channelWrites() { return writes; }
+        UBaseType_t stackHighWaterMark() { return renderTaskHandle ? uxTaskGetStackHighWaterMark(renderTaskHandle) : 0; }
+
+    private:
+        TaskHandle_t renderTaskHandle = NULL;
+        portMUX_TYPE stateMux = portMUX_INITIALIZER_UNLOCKED;
+        LedState state; // latest published state, guarded by stateMux
+        volatile LedMode mode = LED_MODE_POSITION;
+        uint8_t back[LED_CHANNELS]; // frame being drawn
+        int16_t front[LED_CHANNELS]; // duty last written to each channel, -1 if never
+        uint32_t frames = 0;
+        uint32_t writes = 0;
+        uint32_t skipped = 0;
+
+        static void renderTask(void *param);
+        void draw(const LedState &s);
+        void present();
+        void levelDisplay(byte level);
+};
+
+void LedRenderer::init()
+{
+    for (int i = 0; i < LED_CHANNELS; i++) {
+        back[i] = 0;
+        front[i] = -1;
+    }
+    xTaskCreatePinnedToCore(renderTask, "leds", 2048, this, 1, &renderTaskHandle, 0);
+}
+
+void LedRenderer::publish(const LedState &s)
+{
+    portENTER_CRITICAL(&stateMux);
+    state = s;
+    portEXIT_CRITICAL(&stateMux);
+}
+
+void LedRenderer::nextMode(int step)
+{
+    mode = LedMode((mode + LED_MODE_COUNT + step) % LED_MODE_COUNT);
+}
+
+void LedRenderer::renderTask(void *param)
+{
+    LedRenderer *renderer = (LedRenderer*)param;
+    TickType_t lastWake = xTaskGetTickCount();
+    for (;;) {
+        renderer->renderFrame();
+        vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(LED_FRAME_MS));
+    }
+}
+
+/**
+ * Draw and write out one frame of the latest published state.
+ * Runs on the render task.
+ */
+void LedRenderer::renderFrame()
+{
+    LedState s;
+    portENTER_CRITICAL(&stateMux);
+    s = state;
+    portEXIT_CRITICAL(&stateMux);
+
+    draw(s);
+    present();
+}
+
+void LedRenderer::draw(const LedState &s)
+{
+    for (int i = 0; i < LED_CHANNELS; i++) {
+        back[i] = 0;
+    }
+
+    switch (mode)
+    {
+    case LED_MODE_POSITION: {
+        byte ledScale = map(abs(s.position), 0, ACTUATOR_MAX_POS, 1, LED_MAX_DUTY);
+        byte ledState1 = (s.position < 0) ? ledScale : 0;
+        byte ledState2 = (s.position > 0) ? ledScale : 0;
+        back[ENC_LED_N] = back[ENC_LED_SE] = back[ENC_LED_SW] = ledState1;
+        back[ENC_LED_NE] = back[ENC_LED_NW] = back[ENC_LED_S] = ledState2;
+
+        if (s.vibrationMax > 0) {
+            byte vibScale = map(abs(s.vibrationPos), 0, s.vibrationMax, 1, LED_MAX_DUTY);
+            back[ENC_LED_W] = (s.vibrationPos < 0) ? vibScale : 0;
+            back[ENC_LED_E] = (s.vibrationPos > 0) ? vibScale : 0;
+        }
+        break;
+    }
+    case LED_MODE_INTENSITY: {
+        byte duty = map(s.intensity, 0, 255, 0, LED_MAX_DUTY);
+        for (int i = ENC_LED_E; i <= ENC_LED_NE; i++) {
+            back[i] = duty;
+        }
+        break;
+    }
+    case LED_MODE_BUFFER:
+        levelDisplay(s.bufferLevel);
+        break;
+    case LED_MODE_PROGRESS:
+        levelDisplay(s.progress);
+        break;
+    default:
+        break;
+    }
+
+    back[PEND_LED] = s.pendantPresent ? LED_HARDWARE_DUTY : 0;
+    back[ACT_LED] = s.actuatorPresent ? LED_HARDWARE_DUTY : 0;
+}
+
+/**
+ * Write only the channels that changed since the last frame.
+ */
+void LedRenderer::present()
+{
+    frames++;
+    for (int i = 0; i < LED_CHANNELS; i++) {
+        if (front[i] == back[i]) {
+            skipped++;
+            continue;
+        }
+        ledcWrite(i, back[i]);
+        front[i] = back[i];
+        writes++;
+    }
+}
+
+/**
+ * Level ring like ledLevelDisplay(), drawn into the back buffer.
+ * Each LED is capped at LED_MAX_DUTY once its segment is full.
+ */
+void LedRenderer::levelDisplay(byte level)
+{
+    const byte ring[] = { ENC_LED_N, ENC_LED_NE, ENC_LED_E, ENC_LED_SE, ENC_LED_S, ENC_LED_SW, ENC_LED_W, ENC_LED_NW };
+    for (int i = 0; i < 8; i++) {
+        int low = i * 32;
+        if (level > low) {
+            back[ring[i]] = map(min((int)level, low + 32), low, low + 32, 0, LED_MAX_DUTY);
+        }
+    }
+}
+
+void LedRenderer::printStats(Print &out)
+{
+    out.printf("LEDs: mode %d, %u frames, %u channel writes, %u skipped (%u%%)\n",
+        (int)mode,
+        (unsigned)frames,
+        (unsigned)writes,
+        (unsigned)skipped,
+        (unsigned)(frames ? (uint64_t)skipped * 100 / ((uint64_t)frames * LED_CHANNELS) : 0)
+    );
+}
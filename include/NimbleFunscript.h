@@ -1,12 +1,19 @@
+#pragma once
 #include <Arduino.h>
 #include <SPIFFS.h>
 #include <ArduinoJson.h>
 #include <CircularBuffer.h>
+#include <utility>
 #include "nimbleConModule.h"
+#include "StageProfiler.h"
+#include "PlayerPolicies.h"
+#include "ThermalDerating.h"
+#include "LedRenderer.h"
 
-#define MAX_POSITION_DELTA 50
-#define VIBRATION_MAX_AMP 25
-#define VIBRATION_MAX_SPEED 20.0 // hz
+#define CROSSFADE_DEFAULT 500 // ms
+#define CROSSFADE_MAX 5000 // ms
+#define INTENSITY_KEYFRAMES 8 // upcoming keyframes averaged for the LED intensity display
+#define INTENSITY_MAX_SPEED 400 // position units per second shown as full intensity
 
 struct nimbleFrameState {
     int16_t targetPos = 0; // target position from tcode commands
@@ -17,67 +24,81 @@ struct nimbleFrameState {
     int16_t vibrationPos = 0; // next vibration position
 };
 
-class Keyframe {
-    public:
-        Keyframe(int at = 0, short pos = 50) { set(at, pos); }
-        ~Keyframe() {};
-
-        void set(int at, short pos) {
-            _at = at;
-            _pos = pos;
-        }
-        void copy(Keyframe k) {
-            set(k.at(), k.pos());
-        }
-        short lerpToPos(int t, Keyframe k) {
-            return map(t, at(), k.at(), pos(), k.pos());
-        }
-        bool equals(Keyframe k) {
-            return (at() == k.at() || pos() == k.pos());
-        }
-
-        int at() { return _at; }
-        short pos() { return _pos; }
-
-    private:
-        short _pos = 50;
-        int _at = 0;
-};
+/**
+ * Called when the current file runs out of actions.
+ * Return the path of the next file to stitch onto the end of the
+ * keyframe stream, or NULL to stop at the end of the current file.
+ * The path must stay valid while the file plays.
+ */
+typedef const char* (*NextFileHandler)();
 
-class NimbleFunscript {
+/**
+ * Funscript player, specialized at compile time:
+ *  - BufferSize: keyframes read ahead from the file
+ *  - Interpolation: position between keyframes (LinearInterpolation, CosineInterpolation)
+ *  - Vibration: offset added to the position (SineVibration, NoVibration)
+ *  - Limiter: failsafe on each position sent to the actuator (DeltaLimiter<MaxDelta>)
+ *  - Storage: filesystem the funscript files are read from. Anything with
+ *    open(path) returning a Stream that also has isDirectory(), size(),
+ *    position() and close(), like fs::FS and fs::File.
+ *  - Thermal: force and stroke derating (ThermalDerating, NoDerating)
+ */
+template <int BufferSize = 32,
+          class Interpolation = LinearInterpolation,
+          class Vibration = SineVibration,
+          class Limiter = DeltaLimiter<>,
+          class Storage = fs::FS,
+          class Thermal = ThermalDerating>
+class NimbleFunscriptPlayer {
     public:
-        NimbleFunscript() {
+        NimbleFunscriptPlayer() {
             jsonFilter["at"] = true;
             jsonFilter["pos"] = true;
         }
-        ~NimbleFunscript() { reset(); }
+        ~NimbleFunscriptPlayer() { reset(); }
         void init();
         void start();
         void stop();
         void toggle() { if (isRunning()) stop(); else start(); }
         bool isRunning() { return running; }
-        void initFunscriptFile(fs::FS &fs, const char *path);
-        void updateActuator();
-        void updateEncoderLEDs(bool isOn = true);
-        void updateHardwareLEDs();
-        void updateNetworkLEDs(uint32_t bluetooth = 0, uint32_t wifi = 0);
-        void setVibrationSpeed(float v) { vibrationSpeed = min(max(v, (float)0), (float)VIBRATION_MAX_SPEED); }
-        void setVibrationAmplitude(uint16_t v) { vibrationAmplitude = min(max(v, (uint16_t)0), (uint16_t)VIBRATION_MAX_AMP); }
+        void initFunscriptFile(Storage &fs, const char *path);
+        void setNextFileHandler(NextFileHandler handler) { nextFileHandler = handler; }
+        void setCrossfade(long ms) { crossfade = min(max(ms, 1L), (long)CROSSFADE_MAX); } // keyframe times must stay unique
+        uint16_t getCrossfade() { return crossfade; }
+        bool updateActuator();
+        void getLedState(LedState &state);
+        void setVibrationSpeed(float v) { vibration.setSpeed(v); }
+        void setVibrationAmplitude(uint16_t v) { vibration.setAmplitude(v); }
         void printFrameState(Print& out = Serial);
+        const nimbleFrameState& getFrameState() { return frame; }
+        void printThermalState(Print& out = Serial) { thermal.print(out); }
+        Thermal& getThermal() { return thermal; }
 
     private:
         static const int START_OFFSET = 1000; // 1 sec to allow transition at start
+        typedef decltype(std::declval<Storage&>().open("")) StorageFile;
 
-        File currentFile;
+        Storage *currentFs = NULL;
+        StorageFile currentFile;
+        NextFileHandler nextFileHandler = NULL;
         bool running = false;
         bool started = false;
         bool endOfActions = false;
-        float vibrationSpeed = VIBRATION_MAX_SPEED; // hz
-        uint16_t vibrationAmplitude = 0; // amplitude in position units (0 to 25)
+        bool endOfPlaylist = false;
+        bool stitchPending = false; // next action read starts a stitched file
+        uint16_t crossfade = CROSSFADE_DEFAULT; // ms between the last action of a file and the first of the next
+        long timeOffset = START_OFFSET; // added to each action's "at" of the current file
+        long lastAt = 0; // "at" of the last keyframe pushed to the buffer, 0 if none yet
+        int fileKeyframes = 0; // keyframes read from the current file
+        const char *currentPath = NULL;
+        const char *firstSkipped = NULL; // first of the files skipped in a row for having nothing to play
+        Vibration vibration;
+        Thermal thermal;
         nimbleFrameState frame;
+        uint8_t intensity = 0; // stroke speed of the upcoming keyframes (0 to 255)
         Keyframe currentKeyframe;
         Keyframe nextKeyframe;
-        CircularBuffer<Keyframe*, 32> keyBuffer;
+        CircularBuffer<Keyframe, BufferSize> keyBuffer; // stored by value, no heap use during playback
         long startTime;
         long stopTime;
 
@@ -85,25 +106,40 @@ class NimbleFunscript {
         StaticJsonDocument<64> actionJson;
 
         void reset();
-        int16_t clampPositionDelta();
+        bool openFunscriptFile(const char *path);
+        bool openNextFile();
         void processFunscriptFile();
         void lerpKeyframes();
         void handlePositionChanges();
+        void updateIntensity();
+        void predictDemand();
 };
 
-void NimbleFunscript::init()
+typedef NimbleFunscriptPlayer<> NimbleFunscript;
+
+#define NIMBLE_PLAYER_TEMPLATE template <int BufferSize, class Interpolation, class Vibration, class Limiter, class Storage, class Thermal>
+#define NIMBLE_PLAYER NimbleFunscriptPlayer<BufferSize, Interpolation, Vibration, Limiter, Storage, Thermal>
+
+NIMBLE_PLAYER_TEMPLATE
+void NIMBLE_PLAYER::init()
 {
     initNimbleConModule();
 }
 
-void NimbleFunscript::reset()
+NIMBLE_PLAYER_TEMPLATE
+void NIMBLE_PLAYER::reset()
 {
     currentFile.close();
     keyBuffer.clear();
     running = false;
     started = true;
     endOfActions = false;
-    vibrationAmplitude = 0;
+    endOfPlaylist = false;
+    stitchPending = false;
+    timeOffset = START_OFFSET;
+    lastAt = 0;
+    firstSkipped = NULL;
+    vibration.setAmplitude(0);
     stopTime = 0;
     frame.force = MAX_FORCE;
 
@@ -113,7 +149,8 @@ void NimbleFunscript::reset()
     nextKeyframe.set(0, tmpCurPos);
 }
 
-void NimbleFunscript::start()
+NIMBLE_PLAYER_TEMPLATE
+void NIMBLE_PLAYER::start()
 {
     running = true;
 
@@ -127,52 +164,118 @@ void NimbleFunscript::start()
     }
 }
 
-void NimbleFunscript::stop()
+NIMBLE_PLAYER_TEMPLATE
+void NIMBLE_PLAYER::stop()
 {
     running = false;
     stopTime = millis();
 }
 
-void NimbleFunscript::initFunscriptFile(fs::FS &fs, const char *path)
+NIMBLE_PLAYER_TEMPLATE
+void NIMBLE_PLAYER::initFunscriptFile(Storage &fs, const char *path)
 {
     reset();
+    currentFs = &fs;
+    fileKeyframes = 0;
+    if (!openFunscriptFile(path)) {
+        endOfActions = true; // skipped like any other unplayable file
+    }
+}
+
+NIMBLE_PLAYER_TEMPLATE
+bool NIMBLE_PLAYER::openFunscriptFile(const char *path)
+{
+    currentFile.close();
+    endOfActions = false;
+    currentPath = path;
     Serial.printf("Playing file: %s\n", path);
-    currentFile = fs.open(path);
+    currentFile = currentFs->open(path);
     if (!currentFile || currentFile.isDirectory())
     {
         Serial.println("- failed to open file for reading");
-        return;
+        return false;
     }
     if (!currentFile.available() || !currentFile.find("\"actions\":[")) {
         Serial.println("- failed to find Funscript actions");
-        return;
+        return false;
     }
+    return true;
+}
+
+/**
+ * Stitch the next playlist file onto the end of the keyframe stream.
+ * Its first action is placed one crossfade after the last buffered
+ * keyframe, so playback continues without a reset or buffer stall.
+ * Files with nothing to play are skipped, until the playlist comes back
+ * around to the first one skipped.
+ */
+NIMBLE_PLAYER_TEMPLATE
+bool NIMBLE_PLAYER::openNextFile()
+{
+    if (endOfPlaylist) return false;
+
+    if (fileKeyframes > 0) {
+        firstSkipped = NULL;
+    } else if (!firstSkipped) {
+        firstSkipped = currentPath;
+    }
+
+    for (;;) {
+        const char *path = (nextFileHandler && currentFs) ? nextFileHandler() : NULL;
+        if (!path || (firstSkipped && strcmp(path, firstSkipped) == 0)) {
+            endOfPlaylist = true;
+            return false;
+        }
+        fileKeyframes = 0;
+        if (openFunscriptFile(path)) break;
+        if (!firstSkipped) firstSkipped = path;
+    }
+    stitchPending = (lastAt > 0); // otherwise this is the first file played, keep the start offset
+    return true;
 }
 
 /**
  * Fill the buffer with the next actions in the file.
  * Called during loop.
  */
-void NimbleFunscript::processFunscriptFile()
+NIMBLE_PLAYER_TEMPLATE
+void NIMBLE_PLAYER::processFunscriptFile()
 {
     if (!running) return;
     if (keyBuffer.isFull()) return;
-    if (endOfActions || !currentFile.available()) return;
+    if (endOfActions || !currentFile.available()) {
+        if (!openNextFile()) return;
+    }
 
+    PROFILE_START(STAGE_PARSE);
     do {
         DeserializationError error = deserializeJson(actionJson, currentFile, DeserializationOption::Filter(jsonFilter));
         if (error == DeserializationError::Ok) {
             //serializeJsonPretty(actionJson, Serial);
-            keyBuffer.push(new Keyframe(
-                actionJson["at"].as<int>() + START_OFFSET,
+            int at = actionJson["at"].as<int>();
+            if (stitchPending) {
+                stitchPending = false;
+                timeOffset = lastAt + crossfade - at;
+            }
+            lastAt = at + timeOffset;
+            fileKeyframes++;
+            PROFILE_KEYFRAMES(1);
+            keyBuffer.push(Keyframe(
+                lastAt,
                 actionJson["pos"].as<short>()
             ));
         } else if (error != DeserializationError::EmptyInput) {
-            Serial.println(error.f_str());
-            return;
+            // Play what was read, the rest of the file can't be trusted
+            Serial.println(error.c_str());
+            endOfActions = true;
+            break;
         }
         endOfActions = !currentFile.findUntil(",", "]");
+        if (endOfActions && !keyBuffer.isFull()) {
+            openNextFile();
+        }
     } while (!endOfActions && !keyBuffer.isFull());
+    PROFILE_END(STAGE_PARSE);
 
     // Don't start playing until after buffer initially filled
     if (started) {
@@ -181,7 +284,8 @@ void NimbleFunscript::processFunscriptFile()
     }
 }
 
-void NimbleFunscript::lerpKeyframes()
+NIMBLE_PLAYER_TEMPLATE
+void NIMBLE_PLAYER::lerpKeyframes()
 {
     if (!running) return;
     if (started) return; // Don't start playing until initially loaded
@@ -191,45 +295,43 @@ void NimbleFunscript::lerpKeyframes()
     // Shift keyframes and pull next action off buffer when time exceeded
     if (now >= nextKeyframe.at() && !keyBuffer.isEmpty()) {
         currentKeyframe.copy(nextKeyframe);
-        Keyframe* kf = keyBuffer.shift();
-        nextKeyframe.set(kf->at(), kf->pos());
-        delete kf;
+        nextKeyframe.copy(keyBuffer.shift());
+        updateIntensity();
+        predictDemand();
         // Serial.printf("KF %08d:%03d -> %08d:%03d\n",
         //     currentKeyframe.at(), currentKeyframe.pos(),
         //     nextKeyframe.at(), nextKeyframe.pos()
         // );
     }
 
-    // Skip duplicate keyframes
-    if (currentKeyframe.equals(nextKeyframe)) return;
+    // Nothing to interpolate between keyframes at the same time: the initial
+    // pair, or a repeated "at" in a file the importer could not repair
+    if (currentKeyframe.at() == nextKeyframe.at()) return;
 
     // Skip if at end
     if (now > nextKeyframe.at()) return;
 
     // Interpolate position betweeen keyframes for the current time
-    short lerp = currentKeyframe.lerpToPos(now, nextKeyframe);
-    frame.targetPos = map(lerp, 0, 100, -ACTUATOR_MAX_POS, ACTUATOR_MAX_POS);
+    short lerp = Interpolation::lerp(now, currentKeyframe, nextKeyframe);
+    frame.targetPos = thermal.stroke(map(lerp, 0, 100, -ACTUATOR_MAX_POS, ACTUATOR_MAX_POS));
     //Serial.printf("lerp = %d\n", lerp);
 }
 
-void NimbleFunscript::handlePositionChanges()
+NIMBLE_PLAYER_TEMPLATE
+void NIMBLE_PLAYER::handlePositionChanges()
 {
     if (!running) return;
-    if (vibrationAmplitude > 0 && vibrationSpeed > 0) {
-        int vibSpeedMillis = 1000 / vibrationSpeed;
-        int vibModMillis = millis() % vibSpeedMillis;
-        float tempPos = float(vibModMillis) / vibSpeedMillis;
-        int vibWaveDeg = tempPos * 360;
-        frame.vibrationPos = round(sin(radians(vibWaveDeg)) * vibrationAmplitude);
-    } else {
-        frame.vibrationPos = 0;
+    if (!Vibration::enabled) {
+        frame.position = frame.targetPos;
+        return;
     }
-    // Serial.printf("A:%5d S:%0.2f P:%5d\n",
-    //     vibrationAmplitude,
-    //     vibrationSpeed,
-    //     vibrationPos
+    frame.vibrationPos = vibration.offset(millis());
+    // Serial.printf("A:%5d P:%5d\n",
+    //     vibration.amplitude(),
+    //     frame.vibrationPos
     // );
 
+    int vibrationAmplitude = vibration.amplitude();
     int targetPosTmp = frame.targetPos;
     if (frame.targetPos - vibrationAmplitude < -ACTUATOR_MAX_POS) {
         targetPosTmp = frame.targetPos + vibrationAmplitude;
@@ -239,20 +341,33 @@ void NimbleFunscript::handlePositionChanges()
     frame.position = targetPosTmp + frame.vibrationPos;
 }
 
-void NimbleFunscript::updateActuator()
+/**
+ * Returns true when a packet was sent to the actuator this call.
+ */
+NIMBLE_PLAYER_TEMPLATE
+bool NIMBLE_PLAYER::updateActuator()
 {
     // Update interpolations
     processFunscriptFile();
+    PROFILE_START(STAGE_LERP);
     lerpKeyframes();
+    PROFILE_END(STAGE_LERP);
+    PROFILE_START(STAGE_VIBRATION);
     handlePositionChanges();
+    PROFILE_END(STAGE_VIBRATION);
 
     // Send packet of values to the actuator when time is ready
-    if (checkTimer())
+    bool sent = checkTimer();
+    if (sent)
     {
         if (isRunning()) {
-            frame.lastPos = clampPositionDelta();
+            int16_t lastPos = frame.lastPos;
+            PROFILE_START(STAGE_CLAMP);
+            frame.lastPos = Limiter::clamp(frame.position, frame.lastPos);
+            PROFILE_END(STAGE_CLAMP);
             actuator.positionCommand = frame.lastPos;
-            actuator.forceCommand = frame.force;
+            actuator.forceCommand = thermal.force(frame.force);
+            thermal.update(frame.lastPos - lastPos, actuator.forceCommand, actuator.tempLimiting);
             actuator.airIn = (frame.air > 0);
             actuator.airOut = (frame.air < 0);
         } else {
@@ -260,17 +375,15 @@ void NimbleFunscript::updateActuator()
             actuator.airOut = false;
             actuator.forceCommand = IDLE_FORCE;
         }
+        PROFILE_START(STAGE_ENCODE);
         sendToAct();
+        PROFILE_END(STAGE_ENCODE);
     }
 
     if (readFromAct()) // Read current state from actuator.
     { // If the function returns true, the values were updated.
 
-        // Unclear yet if any action is required when tempLimiting is occurring.
-        // A comparison is needed with the Pendant behavior.
-        // if (actuator.tempLimiting) {
-        //     setRunMode(RUN_MODE_OFF);
-        // }
+        // actuator.tempLimiting is handled by the Thermal derating policy
 
         // Serial.printf("A P:%4d F:%4d T:%s\n",
         //     actuator.positionFeedback,
@@ -278,68 +391,65 @@ void NimbleFunscript::updateActuator()
         //     actuator.tempLimiting ? "true" : "false"
         // );
     }
+    return sent;
 }
 
 /**
- * Failsafe to limit position changes between frames to a maximum delta
+ * Average speed over the next few keyframes, for the LED intensity display.
+ * Updated once per keyframe rather than every loop.
  */
-int16_t NimbleFunscript::clampPositionDelta()
+NIMBLE_PLAYER_TEMPLATE
+void NIMBLE_PLAYER::updateIntensity()
 {
-    int16_t delta = frame.position - frame.lastPos;
-    if (delta >= 0) {
-        return (delta > MAX_POSITION_DELTA) ? frame.lastPos + MAX_POSITION_DELTA : frame.position;
-    } else {
-        return (delta < -MAX_POSITION_DELTA) ? frame.lastPos - MAX_POSITION_DELTA : frame.position;
+    Keyframe prev = nextKeyframe;
+    long distance = abs(nextKeyframe.pos() - currentKeyframe.pos());
+    int n = min((int)keyBuffer.size(), INTENSITY_KEYFRAMES);
+    for (int i = 0; i < n; i++) {
+        Keyframe k = keyBuffer[i];
+        distance += abs(k.pos() - prev.pos());
+        prev = k;
     }
+    long duration = prev.at() - currentKeyframe.at();
+    long speed = (duration > 0) ? distance * 1000 / duration : 0;
+    intensity = map(min(speed, (long)INTENSITY_MAX_SPEED), 0, INTENSITY_MAX_SPEED, 0, 255);
 }
 
-void NimbleFunscript::updateEncoderLEDs(bool isOn)
+/**
+ * Average velocity x force of the keyframes ahead, over the whole buffer,
+ * for the thermal derating to act on before they play.
+ * Updated once per keyframe rather than every loop.
+ */
+NIMBLE_PLAYER_TEMPLATE
+void NIMBLE_PLAYER::predictDemand()
 {
-    int16_t pos = frame.lastPos;
-    int16_t vibPos = frame.vibrationPos;
-
-    byte ledScale = map(abs(pos), 0, ACTUATOR_MAX_POS, 1, LED_MAX_DUTY);
-    byte ledState1 = 0;
-    byte ledState2 = 0;
-    byte vibScale = map(abs(vibPos), 0, VIBRATION_MAX_AMP, 1, LED_MAX_DUTY);
-    byte vibState1 = 0;
-    byte vibState2 = 0;
-
-    if (isOn)
-    {
-        if (pos < 0) {
-            ledState1 = ledScale;
-        } else if (pos > 0) {
-            ledState2 = ledScale;
-        }
-
-        if (vibPos < 0) {
-            vibState1 = vibScale;
-        } else if (vibPos > 0) {
-            vibState2 = vibScale;
+    const float scale = 2.0 * ACTUATOR_MAX_POS / 100 * THERMAL_TICK_MS; // pos per ms to actuator units per tick
+    Keyframe prev = currentKeyframe;
+    float demand = 0;
+    long horizon = 0;
+    for (int i = -1; i < (int)keyBuffer.size(); i++) {
+        Keyframe k = (i < 0) ? nextKeyframe : keyBuffer[i];
+        long duration = k.at() - prev.at();
+        if (duration > 0) {
+            demand += thermalDemand(abs(k.pos() - prev.pos()) * scale / duration, frame.force) * duration;
+            horizon += duration;
         }
+        prev = k;
     }
-
-    ledcWrite(ENC_LED_N,  ledState1);
-    ledcWrite(ENC_LED_SE, ledState1);
-    ledcWrite(ENC_LED_SW, ledState1);
-
-    ledcWrite(ENC_LED_NE, ledState2);
-    ledcWrite(ENC_LED_NW, ledState2);
-    ledcWrite(ENC_LED_S,  ledState2);
-
-    ledcWrite(ENC_LED_W, vibState1);
-    ledcWrite(ENC_LED_E, vibState2);
+    thermal.predict((horizon > 0) ? demand / horizon : 0);
 }
 
-void NimbleFunscript::updateHardwareLEDs()
+NIMBLE_PLAYER_TEMPLATE
+void NIMBLE_PLAYER::getLedState(LedState &state)
 {
-    ledcWrite(PEND_LED, (pendant.present) ? 50 : 0);
-    ledcWrite(ACT_LED, (actuator.present) ? 50 : 0);
+    state.position = frame.lastPos;
+    state.vibrationPos = frame.vibrationPos;
+    state.vibrationMax = Vibration::maxAmplitude;
+    state.intensity = running ? intensity : 0;
+    state.bufferLevel = keyBuffer.size() * 255 / BufferSize;
+    state.progress = (currentFile && currentFile.size() > 0) ? currentFile.position() * 255 / currentFile.size() : 0;
+    state.actuatorPresent = actuator.present;
+    state.pendantPresent = pendant.present;
 }
 
-void NimbleFunscript::updateNetworkLEDs(uint32_t bluetooth, uint32_t wifi)
-{
-    ledcWrite(BT_LED, bluetooth);
-    ledcWrite(WIFI_LED, wifi);
-}
+#undef NIMBLE_PLAYER
+#undef NIMBLE_PLAYER_TEMPLATE
@@ -0,0 +1,104 @@
+#pragma once
+#include <Arduino.h>
+#include "nimbleConModule.h"
+
+#define MAX_POSITION_DELTA 50
+#define VIBRATION_MAX_AMP 25
+#define VIBRATION_MAX_SPEED 20.0 // hz
+
+/**
+ * Compile-time policies for NimbleFunscriptPlayer.
+ * Each policy is a small class with inline members, so the selected
+ * behavior is inlined into the player's hot path and unused features
+ * compile out.
+ */
+
+class Keyframe {
+    public:
+        Keyframe(int at = 0, short pos = 50) { set(at, pos); }
+        ~Keyframe() {};
+
+        void set(int at, short pos) {
+            _at = at;
+            _pos = pos;
+        }
+        void copy(Keyframe k) {
+            set(k.at(), k.pos());
+        }
+        short lerpToPos(int t, Keyframe k) {
+            return map(t, at(), k.at(), pos(), k.pos());
+        }
+
+        int at() { return _at; }
+        short pos() { return _pos; }
+
+    private:
+        short _pos = 50;
+        int _at = 0;
+};
+
+// Interpolation policies: position (0 to 100) at time t between two keyframes
+
+struct LinearInterpolation {
+    static short lerp(long t, Keyframe &a, Keyframe &b) {
+        return a.lerpToPos(t, b);
+    }
+};
+
+// Eases in and out of each keyframe, softening direction changes
+struct CosineInterpolation {
+    static short lerp(long t, Keyframe &a, Keyframe &b) {
+        float f = float(t - a.at()) / (b.at() - a.at());
+        return round(a.pos() + (b.pos() - a.pos()) * (1 - cos(f * PI)) / 2);
+    }
+};
+
+// Vibration policies: offset added to the position each loop
+
+class SineVibration {
+    public:
+        static const bool enabled = true;
+        static const uint16_t maxAmplitude = VIBRATION_MAX_AMP;
+
+        void setSpeed(float v) { speed = min(max(v, (float)0), (float)VIBRATION_MAX_SPEED); }
+        void setAmplitude(uint16_t v) { amp = min(max(v, (uint16_t)0), (uint16_t)VIBRATION_MAX_AMP); }
+        uint16_t amplitude() { return amp; }
+
+        int16_t offset(unsigned long ms) {
+            if (amp == 0 || speed <= 0) return 0;
+            int vibSpeedMillis = 1000 / speed;
+            int vibModMillis = ms % vibSpeedMillis;
+            float tempPos = float(vibModMillis) / vibSpeedMillis;
+            int vibWaveDeg = tempPos * 360;
+            return round(sin(radians(vibWaveDeg)) * amp);
+        }
+
+    private:
+        float speed = VIBRATION_MAX_SPEED; // hz
+        uint16_t amp = 0; // amplitude in position units (0 to maxAmplitude)
+};
+
+class NoVibration {
+    public:
+        static const bool enabled = false;
+        static const uint16_t maxAmplitude = 0;
+
+        void setSpeed(float v) {}
+        void setAmplitude(uint16_t v) {}
+        uint16_t amplitude() { return 0; }
+        int16_t offset(unsigned long ms) { return 0; }
+};
+
+// Limiter policies: failsafe applied to each position sent to the actuator
+
+template <int MaxDelta = MAX_POSITION_DELTA>
+struct DeltaLimiter {
+    static int16_t clamp(int16_t position, int16_t lastPos) {
+        int16_t delta = position - lastPos;
+        if (delta >= 0) {
+            return (delta > MaxDelta) ? lastPos + MaxDelta : position;
+        } else {
+            return (delta < -MaxDelta) ? lastPos - MaxDelta : position;
+        }
+    }
+};
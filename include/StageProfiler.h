@@ -0,0 +1,100 @@
+#pragma once
+#include <Arduino.h>
+
+/**
+ * Per-stage cycle counters for the playback pipeline.
+ * Enabled with the PROFILE build flag, otherwise the macros compile out.
+ * The host build counts nanoseconds instead, reported as a 1000 MHz CPU.
+ */
+#ifdef PROFILE
+#define PROFILE_START(stage) profiler.start(stage)
+#define PROFILE_END(stage) profiler.end(stage)
+#define PROFILE_KEYFRAMES(n) profiler.addKeyframes(n)
+#else
+#define PROFILE_START(stage)
+#define PROFILE_END(stage)
+#define PROFILE_KEYFRAMES(n)
+#endif
+
+enum ProfileStage {
+    STAGE_PARSE,     // reading actions from the file into the buffer
+    STAGE_LERP,      // keyframe interpolation
+    STAGE_VIBRATION, // vibration and position offset
+    STAGE_CLAMP,     // position delta failsafe
+    STAGE_ENCODE,    // packet encoding and serial write
+    STAGE_LEDS,      // LED updates on the control loop
+    STAGE_COUNT
+};
+
+#ifdef ARDUINO_ARCH_ESP32
+inline uint32_t profileCycles() { return ESP.getCycleCount(); }
+inline uint32_t profileCyclesPerMicro() { return getCpuFrequencyMhz(); }
+#else
+#include <time.h>
+inline uint32_t profileCycles()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+inline uint32_t profileCyclesPerMicro() { return 1000; }
+#endif
+
+struct StageStats {
+    uint32_t calls = 0;
+    uint64_t cycles = 0;
+    uint32_t maxCycles = 0;
+};
+
+class StageProfiler {
+    public:
+        void start(ProfileStage stage) { startCycles[stage] = profileCycles(); }
+        void end(ProfileStage stage);
+        void addKeyframes(uint32_t n) { keyframes += n; }
+        void reset();
+        void print(Print &out = Serial);
+        const StageStats& getStats(ProfileStage stage) { return stats[stage]; }
+        uint32_t getKeyframes() { return keyframes; }
+
+    private:
+        uint32_t startCycles[STAGE_COUNT];
+        StageStats stats[STAGE_COUNT];
+        uint32_t keyframes = 0;
+};
+
+void StageProfiler::end(ProfileStage stage)
+{
+    uint32_t elapsed = profileCycles() - startCycles[stage];
+    StageStats &s = stats[stage];
+    s.calls++;
+    s.cycles += elapsed;
+    if (elapsed > s.maxCycles) s.maxCycles = elapsed;
+}
+
+void StageProfiler::reset()
+{
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        stats[i] = StageStats();
+    }
+    keyframes = 0;
+}
+
+void StageProfiler::print(Print &out)
+{
+    static const char *names[STAGE_COUNT] = { "parse", "lerp", "vibration", "clamp", "encode", "leds" };
+    uint32_t cyclesPerMicro = profileCyclesPerMicro();
+
+    out.println("Stage        calls    avg us    max us");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        StageStats &s = stats[i];
+        float avg = s.calls ? float(s.cycles) / s.calls / cyclesPerMicro : 0;
+        out.printf("%-10s %7u %9.2f %9.2f\n", names[i], (unsigned)s.calls, avg, float(s.maxCycles) / cyclesPerMicro);
+    }
+
+    float parseSecs = float(stats[STAGE_PARSE].cycles) / cyclesPerMicro / 1000000;
+    out.printf("Keyframes: %u (%.0f/s parsed)\n", (unsigned)keyframes, parseSecs > 0 ? keyframes / parseSecs : 0);
+}
+
+#ifdef PROFILE
+StageProfiler profiler;
+#endif
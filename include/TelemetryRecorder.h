@@ -0,0 +1,282 @@
+#pragma once
+#include <Arduino.h>
+#include <FS.h>
+#include "NimbleFunscript.h"
+
+#define TELEMETRY_PATH "/telemetry.bin"
+#define TELEMETRY_OLD_PATH "/telemetry.old"
+#define TELEMETRY_MAGIC 0x4C54464E // "NFTL"
+#define TELEMETRY_VERSION 2
+#define TELEMETRY_BLOCK_RECORDS 128 // records per flash write (2.5 KB)
+#define TELEMETRY_BLOCKS 4 // ring buffer depth in blocks
+#define TELEMETRY_MAX_BYTES 262144 // log rotates to TELEMETRY_OLD_PATH after this size
+
+// Record flag bits
+#define TELEMETRY_AIR_IN 0x01
+#define TELEMETRY_AIR_OUT 0x02
+#define TELEMETRY_TEMP_LIMITING 0x04
+#define TELEMETRY_SENSOR_FAULT 0x08
+#define TELEMETRY_ACT_PRESENT 0x10
+
+struct __attribute__((packed)) TelemetryHeader {
+    uint32_t magic = TELEMETRY_MAGIC;
+    uint16_t version = TELEMETRY_VERSION;
+    uint16_t recordSize;
+    uint32_t bootId; // random per boot, millis() restarts with each one
+};
+
+/**
+ * One control tick: frame state, the command sent to the actuator
+ * and the latest feedback read from it.
+ */
+struct __attribute__((packed)) TelemetryRecord {
+    uint32_t ms;
+    int16_t targetPos;
+    int16_t position;
+    int16_t vibrationPos;
+    int16_t positionCommand;
+    int16_t forceCommand;
+    int16_t positionFeedback;
+    int16_t forceFeedback;
+    int8_t air;
+    uint8_t flags;
+};
+
+/**
+ * Ring-buffered binary recorder.
+ *
+ * record() only copies into RAM. Full blocks are written to flash in one
+ * batch by a background task on the other core. If flash falls behind, new
+ * records are dropped and counted rather than queued. Each block is flushed,
+ * so a session ending in power off or a crash loses at most the blocks not
+ * yet written.
+ *
+ * The control loop still waits on flash: while a write, flush or sector erase
+ * is in progress the cache is disabled and the other core is parked, and file
+ * reads wait on the SPIFFS lock. Erases can take tens of ms, so expect late
+ * packets while recording. The "m" and "d" commands print how many packets
+ * were late, and the decoder reports the gaps between records.
+ *
+ * Decode logs with tools/telemetry_decode.py.
+ */
+class TelemetryRecorder {
+    public:
+        void init(fs::FS &fs);
+        void start();
+        void stop();
+        bool isRecording() { return recording; }
+        void record(const nimbleFrameState &frame, const Actuator &act);
+        void dump(Print &out = Serial);
+        bool isDumping() { return dumpOut != NULL; }
+        uint32_t droppedRecords() { return dropped; }
+        UBaseType_t stackHighWaterMark() { return flushTaskHandle ? uxTaskGetStackHighWaterMark(flushTaskHandle) : 0; }
+
+    private:
+        fs::FS *logFs = NULL;
+        File logFile;
+        TaskHandle_t flushTaskHandle = NULL;
+        volatile bool recording = false;
+        volatile bool flushPartial = false;
+        Print * volatile dumpOut = NULL; // dump requested, written by the background task
+        bool resumeAfterDump = false;
+        uint32_t bootId = 0;
+        volatile uint8_t head = 0; // block being filled by record()
+        volatile uint8_t tail = 0; // next block to be written to flash
+        uint16_t headCount = 0; // records in the head block
+        volatile uint32_t dropped = 0;
+        uint32_t fileBytes = 0;
+        TelemetryRecord blocks[TELEMETRY_BLOCKS][TELEMETRY_BLOCK_RECORDS];
+
+        static void flushTask(void *param);
+        void flushBlocks();
+        void openLog();
+        void rotateLog();
+        void writeLog(const void *data, size_t len);
+        void closeLog();
+        void dumpLogs();
+        void dumpFile(Print &out, const char *path);
+};
+
+void TelemetryRecorder::init(fs::FS &fs)
+{
+    logFs = &fs;
+    bootId = esp_random();
+    xTaskCreatePinnedToCore(flushTask, "telemetry", 4096, this, 1, &flushTaskHandle, 0);
+}
+
+void TelemetryRecorder::start()
+{
+    if (recording || !logFs) return;
+    head = tail = 0;
+    headCount = 0;
+    dropped = 0;
+    rotateLog(); // keep the previous session
+    recording = true;
+}
+
+/**
+ * Stop recording and wait for the background task to write out the
+ * partially filled block and close the log.
+ */
+void TelemetryRecorder::stop()
+{
+    if (!recording) return;
+    recording = false;
+    flushPartial = true;
+    xTaskNotifyGive(flushTaskHandle);
+    while (flushPartial) vTaskDelay(pdMS_TO_TICKS(1));
+}
+
+void TelemetryRecorder::record(const nimbleFrameState &frame, const Actuator &act)
+{
+    if (!recording) return;
+    if (headCount >= TELEMETRY_BLOCK_RECORDS) {
+        uint8_t next = (head + 1) % TELEMETRY_BLOCKS;
+        if (next == tail) { // flash writer has fallen behind
+            dropped++;
+            return;
+        }
+        head = next;
+        headCount = 0;
+    }
+
+    TelemetryRecord &r = blocks[head][headCount];
+    r.ms = millis();
+    r.targetPos = frame.targetPos;
+    r.position = frame.position;
+    r.vibrationPos = frame.vibrationPos;
+    r.positionCommand = act.positionCommand;
+    r.forceCommand = act.forceCommand;
+    r.positionFeedback = act.positionFeedback;
+    r.forceFeedback = act.forceFeedback;
+    r.air = frame.air;
+    r.flags = (act.airIn ? TELEMETRY_AIR_IN : 0)
+        | (act.airOut ? TELEMETRY_AIR_OUT : 0)
+        | (act.tempLimiting ? TELEMETRY_TEMP_LIMITING : 0)
+        | (act.sensorFault ? TELEMETRY_SENSOR_FAULT : 0)
+        | (act.present ? TELEMETRY_ACT_PRESENT : 0);
+
+    if (++headCount >= TELEMETRY_BLOCK_RECORDS) {
+        xTaskNotifyGive(flushTaskHandle);
+    }
+}
+
+void TelemetryRecorder::flushTask(void *param)
+{
+    TelemetryRecorder *recorder = (TelemetryRecorder*)param;
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        recorder->flushBlocks();
+        if (recorder->dumpOut) recorder->dumpLogs();
+    }
+}
+
+/**
+ * Write completed blocks to flash. Runs on the background task.
+ */
+void TelemetryRecorder::flushBlocks()
+{
+    while (tail != head) {
+        writeLog(blocks[tail], sizeof(blocks[tail]));
+        if (logFile) logFile.flush();
+        tail = (tail + 1) % TELEMETRY_BLOCKS;
+    }
+
+    if (flushPartial || (dumpOut && logFile)) {
+        closeLog();
+        flushPartial = false;
+    }
+}
+
+/**
+ * Write out the partially filled head block and close the log.
+ * Only called once record() is stopped, so the head block is no longer being written to.
+ */
+void TelemetryRecorder::closeLog()
+{
+    writeLog(blocks[head], headCount * sizeof(TelemetryRecord));
+    headCount = 0;
+    logFile.close();
+    Serial.printf("Telemetry stopped, %u bytes, %u dropped\n", (unsigned)fileBytes, (unsigned)dropped);
+}
+
+void TelemetryRecorder::openLog()
+{
+    logFile = logFs->open(TELEMETRY_PATH, FILE_WRITE);
+    if (!logFile) {
+        Serial.println("- failed to open telemetry log for writing");
+        return;
+    }
+    fileBytes = 0;
+    TelemetryHeader header;
+    header.recordSize = sizeof(TelemetryRecord);
+    header.bootId = bootId;
+    writeLog(&header, sizeof(header));
+}
+
+void TelemetryRecorder::writeLog(const void *data, size_t len)
+{
+    if (!logFile || len == 0) return;
+    fileBytes += logFile.write((const uint8_t*)data, len);
+
+    // Keep the log bounded, retaining the previous segment
+    if (fileBytes >= TELEMETRY_MAX_BYTES) {
+        rotateLog();
+    }
+}
+
+void TelemetryRecorder::rotateLog()
+{
+    logFile.close();
+    if (logFs->exists(TELEMETRY_PATH)) {
+        logFs->remove(TELEMETRY_OLD_PATH);
+        logFs->rename(TELEMETRY_PATH, TELEMETRY_OLD_PATH);
+    }
+    openLog();
+}
+
+/**
+ * Print the logs as hex lines, for capture from the serial monitor.
+ *
+ * Recording pauses while the background task prints, which takes about
+ * 90 seconds for full logs, so the control loop keeps running meanwhile.
+ */
+void TelemetryRecorder::dump(Print &out)
+{
+    if (!logFs || dumpOut) return;
+    resumeAfterDump = recording;
+    recording = false;
+    dumpOut = &out;
+    xTaskNotifyGive(flushTaskHandle);
+}
+
+/**
+ * Runs on the background task, after the log has been written out and closed.
+ */
+void TelemetryRecorder::dumpLogs()
+{
+    Print &out = *dumpOut;
+    out.println("-- telemetry begin --");
+    dumpFile(out, TELEMETRY_OLD_PATH);
+    dumpFile(out, TELEMETRY_PATH);
+    out.println("-- telemetry end --");
+    dumpOut = NULL;
+    if (resumeAfterDump) start();
+}
+
+void TelemetryRecorder::dumpFile(Print &out, const char *path)
+{
+    if (!logFs->exists(path)) return;
+    File f = logFs->open(path);
+    if (!f) return;
+    out.printf("-- file %s --\n", path);
+    uint8_t buf[32];
+    size_t n;
+    while ((n = f.read(buf, sizeof(buf))) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            out.printf("%02x", buf[i]);
+        }
+        out.println();
+    }
+    f.close();
+}
@@ -0,0 +1,155 @@
+#pragma once
+#include <Arduino.h>
+#include "PlayerPolicies.h"
+
+#define THERMAL_TICK_MS (SEND_INTERVAL / 1000.0) // ms between actuator packets
+#define THERMAL_DEMAND_TAU 20000.0 // ms, window of recent power demand
+#define THERMAL_LIMIT_TAU 10000.0 // ms, window of time spent temp limited
+#define THERMAL_BUDGET_MARGIN 0.9 // budget as a fraction of the demand that caused limiting
+#define THERMAL_BUDGET_MIN 0.05
+#define THERMAL_BUDGET_DECAY 0.00001 // per ms while still limited, x0.5 to x1.5 with the time limited
+#define THERMAL_BUDGET_RECOVERY 0.000001 // per ms while not limited, to probe back up
+#define THERMAL_DERATE_MIN 0.5
+#define THERMAL_DERATE_RATE 0.0002 // max derate change per ms (0.2 per second)
+
+/**
+ * Power demand of one tick (0 to 1): position change per tick x force.
+ */
+float thermalDemand(float positionDelta, long force)
+{
+    return min(fabs(positionDelta) / float(MAX_POSITION_DELTA), (float)1) * force / MAX_FORCE;
+}
+
+/**
+ * Thermal derating policy for NimbleFunscriptPlayer.
+ *
+ * Power demand is estimated each tick as velocity x force (0 to 1). The
+ * player also reports the demand of its buffered keyframes, assumed to carry
+ * on, so derating starts as a heavier section starts rather than once the
+ * recent demand has caught up with it. When the actuator starts temp
+ * limiting, the recent demand is learned as the thermal budget. The budget
+ * keeps dropping while it is limiting, faster the more of the recent window
+ * was spent limiting, and slowly recovers once it is not.
+ * Force and stroke are smoothly scaled down so the recent demand stays within
+ * budget, keeping the actuator just below its limit instead of hitting it.
+ */
+class ThermalDerating {
+    public:
+        void update(int16_t positionDelta, long force, bool tempLimiting);
+        void predict(float demand);
+        long force(long f) { return f * derate; }
+        int16_t stroke(int16_t position) { return position * derate; }
+        void print(Print &out = Serial);
+
+    private:
+        float derate = 1; // applied to force and stroke (THERMAL_DERATE_MIN to 1)
+        float demand = 0; // recent demand, before derating
+        float upcoming = 0; // demand of the buffered keyframes, before derating
+        float limited = 0; // recent fraction of time spent temp limited
+        float budget = 1; // sustainable demand
+        bool wasLimiting = false;
+};
+
+/**
+ * Called once per packet sent, with the commanded (derated) values.
+ */
+void ThermalDerating::update(int16_t positionDelta, long force, bool tempLimiting)
+{
+    // Derating scales both velocity and force, so the raw demand is d^2 larger
+    float tickDemand = thermalDemand(positionDelta, force) / (derate * derate);
+    demand += (tickDemand - demand) * THERMAL_TICK_MS / THERMAL_DEMAND_TAU;
+    limited += ((tempLimiting ? 1 : 0) - limited) * THERMAL_TICK_MS / THERMAL_LIMIT_TAU;
+
+    if (tempLimiting && !wasLimiting) {
+        // What we are asking for now is more than the actuator can sustain
+        budget = min(budget, demand * derate * derate * (float)THERMAL_BUDGET_MARGIN);
+    } else if (tempLimiting) {
+        // Cut gently through a brief trip, harder the longer it has been limiting
+        budget -= THERMAL_BUDGET_DECAY * (0.5 + limited) * THERMAL_TICK_MS;
+    } else {
+        budget += THERMAL_BUDGET_RECOVERY * THERMAL_TICK_MS;
+    }
+    budget = min(max(budget, (float)THERMAL_BUDGET_MIN), (float)1);
+    wasLimiting = tempLimiting;
+
+    // Ease off only once a heavy section has actually passed
+    float expected = max(demand, upcoming);
+    float target = (expected > budget) ? sqrt(budget / expected) : 1;
+    target = max(target, (float)THERMAL_DERATE_MIN);
+    float step = THERMAL_DERATE_RATE * THERMAL_TICK_MS;
+    derate += min(max(target - derate, -step), step);
+}
+
+/**
+ * Called once per keyframe, with the average demand of the keyframes
+ * buffered after it.
+ */
+void ThermalDerating::predict(float demand)
+{
+    upcoming = demand;
+}
+
+void ThermalDerating::print(Print &out)
+{
+    out.printf("Thermal: derate %.2f, demand %.2f, upcoming %.2f, budget %.2f, limited %.0f%%\n",
+        derate, demand, upcoming, budget, limited * 100);
+}
+
+class NoDerating {
+    public:
+        void update(int16_t positionDelta, long force, bool tempLimiting) {}
+        void predict(float demand) {}
+        long force(long f) { return f; }
+        int16_t stroke(int16_t position) { return position; }
+        void print(Print &out = Serial) {}
+};
+
+#ifdef THERMAL_SIM
+#define THERMAL_SIM_SUSTAINABLE_DEMAND 0.3 // demand that settles exactly at the limit
+#define THERMAL_SIM_COOL_TAU 60000.0 // ms
+
+/**
+ * First order thermal model of the actuator for bench testing the derating
+ * without a real actuator heating up. Heats with commanded velocity x force,
+ * cools towards ambient, and reports temp limiting above its limit.
+ */
+class SimulatedThermalModel {
+    public:
+        bool update(int16_t positionDelta, long force) {
+            float demand = thermalDemand(positionDelta, force);
+            heat += (demand / THERMAL_SIM_SUSTAINABLE_DEMAND - heat) * THERMAL_TICK_MS / THERMAL_SIM_COOL_TAU;
+            limiting = limiting ? (heat > 0.95) : (heat > 1); // with hysteresis
+            return limiting;
+        }
+        bool isLimiting() { return limiting; }
+        float temperature() { return heat; }
+
+    private:
+        float heat = 0; // 1 = limit
+        bool limiting = false;
+};
+
+/**
+ * Thermal policy wrapping another one (ThermalDerating, NoDerating) that
+ * feeds it the simulated temp limiting signal in place of the actuator's.
+ */
+template <class Derating = ThermalDerating>
+class SimulatedThermal {
+    public:
+        void update(int16_t positionDelta, long force, bool tempLimiting) {
+            derating.update(positionDelta, force, model.update(positionDelta, force));
+        }
+        void predict(float demand) { derating.predict(demand); }
+        long force(long f) { return derating.force(f); }
+        int16_t stroke(int16_t position) { return derating.stroke(position); }
+        bool isLimiting() { return model.isLimiting(); }
+        void print(Print &out = Serial) {
+            derating.print(out);
+            out.printf("Simulated heat: %.2f%s\n", model.temperature(), model.isLimiting() ? " (limiting)" : "");
+        }
+
+    private:
+        Derating derating;
+        SimulatedThermalModel model;
+};
+#endif
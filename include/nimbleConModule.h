@@ -1,3 +1,4 @@
+#pragma once
 #include <Arduino.h>
 // From https://github.com/ExploratoryDevices/NimbleConModule (with edits)
 #include <ESP32Encoder.h>   // https://github.com/madhephaestus/ESP32Encoder
@@ -232,10 +233,11 @@ void sendToAct()
     byte outgoingPacket[7], statusByte = 0;
     bool positionNegative = 0;
     int checkWord;
+    long positionCommand = actuator.positionCommand; // keep the signed command for logging
 
-    if (actuator.positionCommand < 0)
+    if (positionCommand < 0)
     {
-        actuator.positionCommand *= -1;
+        positionCommand *= -1;
         positionNegative = 1;
     }
     else
@@ -247,8 +249,8 @@ void sendToAct()
     statusByte |= 0x80; // SYSTEM_TYPE: NimbleStroker
 
     outgoingPacket[0] = statusByte;
-    outgoingPacket[1] = actuator.positionCommand & 0xFF;
-    outgoingPacket[2] = actuator.positionCommand >> 8;
+    outgoingPacket[1] = positionCommand & 0xFF;
+    outgoingPacket[2] = positionCommand >> 8;
     outgoingPacket[2] |= positionNegative << 2;
     outgoingPacket[3] = actuator.forceCommand & 0xFF;
     outgoingPacket[4] = actuator.forceCommand >> 8;
@@ -3,36 +3,107 @@
 #include <BfButton.h>
 #include <millisDelay.h>
 #include "NimbleFunscript.h"
+#include "FunscriptImporter.h"
+#ifdef TELEMETRY
+#include "TelemetryRecorder.h"
+#endif
 
-NimbleFunscript nimble;
+// Vibration is not controlled from this firmware, so it is compiled out
+#ifdef THERMAL_SIM
+NimbleFunscriptPlayer<32, LinearInterpolation, NoVibration, DeltaLimiter<>, fs::FS, SimulatedThermal<> > nimble;
+#else
+NimbleFunscriptPlayer<32, LinearInterpolation, NoVibration> nimble;
+#endif
+FunscriptImporter importer;
+#ifdef TELEMETRY
+TelemetryRecorder telemetry;
+#endif
 
+LedRenderer leds;
+LedState ledState;
 millisDelay ledUpdateDelay;
+long encoderCount = 0;
 
 BfButton btn(BfButton::STANDALONE_DIGITAL, ENC_BUTT, true, LOW);
 
+/**
+ * Publish the player state to the LED renderer, which draws it on its own task.
+ * Turning the encoder dial changes the LED display mode.
+ */
 void updateLEDs()
 {
     if (!ledUpdateDelay.justFinished()) return;
     ledUpdateDelay.repeat();
 
-    nimble.updateEncoderLEDs();
-    nimble.updateHardwareLEDs();
-    //nimble.updateNetworkLEDs();
+    PROFILE_START(STAGE_LEDS);
+    long count = encoder.getCount();
+    if (abs(count - encoderCount) >= 2) {
+        leds.nextMode(count > encoderCount ? 1 : -1);
+        encoderCount = count;
+    }
+    nimble.getLedState(ledState);
+    leds.publish(ledState);
+    PROFILE_END(STAGE_LEDS);
 }
 
+enum PlayMode {
+    PLAY_MODE_SINGLE,   // stop at the end of each file
+    PLAY_MODE_LOOP_ONE, // repeat the current file
+    PLAY_MODE_LOOP_ALL, // play all files in order, then repeat
+    PLAY_MODE_SHUFFLE,  // play files in random order
+    PLAY_MODE_COUNT
+};
+const char* playModeNames[PLAY_MODE_COUNT] = { "single", "loop one", "loop all", "shuffle" };
+PlayMode playMode = PLAY_MODE_SINGLE;
+
 const unsigned MAX_FILES = 10;
-String filenames[MAX_FILES] = {};
+const unsigned MAX_FILENAME = 33; // "/" + 31 chars + null
+char filenames[MAX_FILES][MAX_FILENAME] = {};
 short numFiles = 0;
-short fileIndex = 0;
+short fileIndex = -1; // index of the file currently playing
 
-String nextFile() {
-    short i = fileIndex;
+const char* nextFile() {
+    if (numFiles == 0) return "";
     fileIndex++;
     if (fileIndex >= numFiles) {
         fileIndex = 0;
     }
-    //Serial.printf("File index: %d, Next: %d, Size: %d\n", i, fileIndex, numFilenames);
-    return filenames[i];
+    //Serial.printf("File index: %d, Size: %d\n", fileIndex, numFiles);
+    return filenames[fileIndex];
+}
+
+const char* shuffleFile() {
+    if (numFiles <= 1) return nextFile();
+    if (fileIndex < 0) {
+        fileIndex = random(numFiles);
+        return filenames[fileIndex];
+    }
+    short i = random(numFiles - 1);
+    fileIndex = (i >= fileIndex) ? i + 1 : i; // never repeat the current file
+    return filenames[fileIndex];
+}
+
+/**
+ * Next file handler for gapless playback, depending on the play mode.
+ */
+const char* nextPlaylistFile() {
+    if (numFiles == 0 || fileIndex < 0) return NULL;
+    switch (playMode)
+    {
+    case PLAY_MODE_LOOP_ONE:
+        return filenames[fileIndex];
+    case PLAY_MODE_LOOP_ALL:
+        return nextFile();
+    case PLAY_MODE_SHUFFLE:
+        return shuffleFile();
+    default:
+        return NULL;
+    }
+}
+
+void cyclePlayMode() {
+    playMode = PlayMode((playMode + 1) % PLAY_MODE_COUNT);
+    Serial.printf("Play mode: %s\n", playModeNames[playMode]);
 }
 
 void sortFilenames()
@@ -40,15 +111,24 @@ void sortFilenames()
     if (numFiles <= 1) return;
     for (int i = 0; i < numFiles; i++) {
         for (int j = i + 1; j < numFiles; j++) {
-            if (filenames[j] < filenames[i]) {
-                String q = filenames[i];
-                filenames[i] = filenames[j];
-                filenames[j] = q;
+            if (strcmp(filenames[j], filenames[i]) < 0) {
+                char q[MAX_FILENAME];
+                strcpy(q, filenames[i]);
+                strcpy(filenames[i], filenames[j]);
+                strcpy(filenames[j], q);
             }
         }
     }
 }
 
+bool isFunscript(const char *name)
+{
+    const char *ext = ".funscript";
+    size_t len = strlen(name);
+    size_t extLen = strlen(ext);
+    return len > extLen && strcmp(name + len - extLen, ext) == 0;
+}
+
 void getFunscriptFiles(fs::FS &fs) {
     numFiles = 0;
     Serial.println("Listing dir: /");
@@ -64,10 +144,11 @@ void getFunscriptFiles(fs::FS &fs) {
     File file = root.openNextFile();
     while (file)
     {
-        if (!file.isDirectory() && numFiles < MAX_FILES) {
-            String filename = "/" + String(file.name());
-            if (filename.endsWith(".funscript")) {
-                filenames[numFiles++] = filename;
+        if (!file.isDirectory() && numFiles < MAX_FILES && isFunscript(file.name())) {
+            if (strlen(file.name()) + 2 > MAX_FILENAME) {
+                Serial.printf("Skipping %s: filename too long\n", file.name());
+            } else {
+                snprintf(filenames[numFiles++], MAX_FILENAME, "/%s", file.name());
                 Serial.print(" FILE : ");
                 Serial.print(file.name());
                 Serial.print("\t SIZE: ");
@@ -79,16 +160,37 @@ void getFunscriptFiles(fs::FS &fs) {
     sortFilenames();
 }
 
+/**
+ * Sort and repair files so playback can trust the action order.
+ * Files that fail are left out of the playlist.
+ */
+void importFunscriptFiles(fs::FS &fs) {
+    short kept = 0;
+    for (int i = 0; i < numFiles; i++) {
+        if (!importer.import(fs, filenames[i])) {
+            Serial.printf("Skipping %s: import failed\n", filenames[i]);
+            continue;
+        }
+        if (kept != i) strcpy(filenames[kept], filenames[i]);
+        kept++;
+    }
+    numFiles = kept;
+}
+
 void pressHandler(BfButton *btn, BfButton::press_pattern_t pattern)
 {
     switch (pattern)
     {
     case BfButton::LONG_PRESS:
-        nimble.stop();
+        if (nimble.isRunning()) {
+            nimble.stop();
+        } else {
+            cyclePlayMode();
+        }
         break;
 
     case BfButton::DOUBLE_PRESS:
-        nimble.initFunscriptFile(SPIFFS, nextFile().c_str());
+        nimble.initFunscriptFile(SPIFFS, (playMode == PLAY_MODE_SHUFFLE) ? shuffleFile() : nextFile());
         nimble.start();
         break;
 
@@ -98,6 +200,136 @@ void pressHandler(BfButton *btn, BfButton::press_pattern_t pattern)
     }
 }
 
+#define PACKET_LATE_MS 4 // packets are sent every 2 ms, a longer gap means the control loop stalled
+
+uint32_t lastPacketMs = 0;
+uint32_t maxPacketGap = 0;
+uint32_t latePackets = 0;
+
+/**
+ * Called after each packet sent to the actuator.
+ */
+void onActuatorPacket()
+{
+    // Flash writes and erases stall both cores, so count the packets they delay
+    uint32_t now = millis();
+    if (lastPacketMs) {
+        uint32_t gap = now - lastPacketMs;
+        if (gap > PACKET_LATE_MS) latePackets++;
+        if (gap > maxPacketGap) maxPacketGap = gap;
+    }
+    lastPacketMs = now;
+#ifdef TELEMETRY
+    if (nimble.isRunning()) telemetry.record(nimble.getFrameState(), actuator);
+#endif
+}
+
+uint32_t setupFreeHeap = 0;
+
+void printPacketGaps(Print &out = Serial)
+{
+    out.printf("Packets late: %u (gap over %d ms), max gap %u ms\n",
+        (unsigned)latePackets, PACKET_LATE_MS, (unsigned)maxPacketGap);
+}
+
+/**
+ * Heap and task stack high-water marks, for sizing long unattended runs.
+ * Player memory is statically sized, so free heap should not drop after setup().
+ * Also prints the late packet count, as flash writes stall the control loop.
+ */
+void printMemoryUsage(Print &out = Serial)
+{
+    out.printf("Heap free: %u (setup: %u, min: %u, largest block: %u)\n",
+        (unsigned)ESP.getFreeHeap(),
+        (unsigned)setupFreeHeap,
+        (unsigned)ESP.getMinFreeHeap(),
+        (unsigned)ESP.getMaxAllocHeap()
+    );
+    out.printf("Stack unused: loop %u", (unsigned)uxTaskGetStackHighWaterMark(NULL));
+    out.printf(", leds %u", (unsigned)leds.stackHighWaterMark());
+#ifdef TELEMETRY
+    out.printf(", telemetry %u", (unsigned)telemetry.stackHighWaterMark());
+#endif
+    out.println(" bytes");
+    printPacketGaps(out);
+}
+
+#define SERIAL_ARG_MAX 8 // digits of a command's argument
+
+char argCommand = 0; // command whose argument is still being read
+char commandArg[SERIAL_ARG_MAX + 1];
+uint8_t commandArgLen = 0;
+
+/**
+ * Run a command once its argument has been read. An empty argument prints the current value.
+ */
+void runArgCommand(char command, const char *arg)
+{
+    switch (command)
+    {
+    case 'c': // crossfade between stitched files in ms, e.g. "c250", or just "c" to print it
+    {
+        long ms = atol(arg);
+        if (ms > 0) nimble.setCrossfade(ms);
+        Serial.printf("Crossfade: %u ms\n", (unsigned)nimble.getCrossfade());
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/**
+ * Single character commands from the serial monitor.
+ * One character is read per loop, so reading an argument never blocks the control loop.
+ */
+void handleSerialCommands()
+{
+    if (!Serial.available()) return;
+    char c = Serial.read();
+    if (argCommand) {
+        if (c >= '0' && c <= '9' && commandArgLen < SERIAL_ARG_MAX) {
+            commandArg[commandArgLen++] = c;
+            return;
+        }
+        commandArg[commandArgLen] = '\0';
+        runArgCommand(argCommand, commandArg);
+        argCommand = 0;
+        if (c == '\n' || c == '\r') return;
+    }
+
+    switch (c)
+    {
+    case 'm': // memory high-water marks
+        printMemoryUsage();
+        break;
+    case 'l': // LED renderer stats
+        leds.printStats();
+        break;
+    case 'c': // takes an argument, run at the end of the line
+        argCommand = c;
+        commandArgLen = 0;
+        break;
+    case 't': // thermal derating state
+        nimble.printThermalState();
+        break;
+#ifdef TELEMETRY
+    case 'd': // dump telemetry log
+        printPacketGaps();
+        telemetry.dump();
+        break;
+#endif
+#ifdef PROFILE
+    case 'p': // print and reset stage timings
+        profiler.print();
+        profiler.reset();
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
 void setup()
 {
     nimble.init();
@@ -106,19 +338,34 @@ void setup()
     if (!SPIFFS.begin(true)) {
         Serial.println("An error occurred while mounting SPIFFS");
     }
+    importer.recover(SPIFFS);
     getFunscriptFiles(SPIFFS);
+    importFunscriptFiles(SPIFFS);
+#ifdef TELEMETRY
+    telemetry.init(SPIFFS);
+    telemetry.start();
+#endif
+    nimble.setNextFileHandler(nextPlaylistFile);
+    Serial.printf("Play mode: %s\n", playModeNames[playMode]);
     Serial.println("Ready.");
 
     btn.onPress(pressHandler)
         .onDoublePress(pressHandler)
         .onPressFor(pressHandler, 2000);
 
-    ledUpdateDelay.start(30);
+    leds.init();
+    ledUpdateDelay.start(LED_FRAME_MS);
+
+    setupFreeHeap = ESP.getFreeHeap();
+    printMemoryUsage();
 }
 
 void loop()
 {
     btn.read();
-    nimble.updateActuator();
+    if (nimble.updateActuator()) {
+        onActuatorPacket();
+    }
     updateLEDs();
+    handleSerialCommands();
 }
@@ -0,0 +1,166 @@
+#pragma once
+/**
+ * Minimal Arduino core for the native test env.
+ * Time comes from a virtual clock the tests advance with nativeAdvance().
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+
+using std::min;
+using std::max;
+
+typedef uint8_t byte;
+
+#define PI 3.1415926535897932384626433832795
+#define radians(deg) ((deg) * PI / 180.0)
+#define IRAM_ATTR
+#define INPUT_PULLUP 0x05
+#define LOW 0x0
+#define HIGH 0x1
+#define SERIAL_8N1 0x800001c
+
+unsigned long nativeMillis = 0;
+
+unsigned long millis() { return nativeMillis; }
+unsigned long micros() { return nativeMillis * 1000; }
+void delay(uint32_t ms) { nativeMillis += ms; }
+
+// Same as the ESP32 core, including -1 for an empty input range
+long map(long x, long in_min, long in_max, long out_min, long out_max)
+{
+    const long run = in_max - in_min;
+    if (run == 0) {
+        return -1;
+    }
+    const long rise = out_max - out_min;
+    const long delta = x - in_min;
+    return (delta * rise) / run + out_min;
+}
+
+long random(long howbig) { return howbig > 0 ? rand() % howbig : 0; }
+long random(long howsmall, long howbig) { return howsmall + random(howbig - howsmall); }
+uint32_t esp_random() { return (uint32_t)rand(); }
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+
+uint32_t nativeLedcWrites = 0; // ledcWrite() calls, for comparing LED update paths
+long nativeLedcWriteNs = 0; // host time each ledcWrite() call busy-waits, to model the device's
+
+void ledcWrite(uint8_t channel, uint32_t duty)
+{
+    nativeLedcWrites++;
+    if (nativeLedcWriteNs <= 0) return;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec) < nativeLedcWriteNs);
+}
+void ledcAttachPin(uint8_t pin, uint8_t channel) {}
+double ledcSetup(uint8_t channel, double freq, uint8_t bits) { return freq; }
+
+struct hw_timer_t {};
+hw_timer_t nativeTimer;
+hw_timer_t *timerBegin(uint8_t num, uint16_t divider, bool countUp) { return &nativeTimer; }
+void timerAttachInterrupt(hw_timer_t *timer, void (*fn)(void), bool edge) {}
+void timerAlarmWrite(hw_timer_t *timer, uint64_t alarmValue, bool autoreload) {}
+void timerAlarmEnable(hw_timer_t *timer) {}
+
+// FreeRTOS, tasks are not run natively
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL(mux)
+#define portENTER_CRITICAL_ISR(mux)
+#define portEXIT_CRITICAL_ISR(mux)
+#define portMAX_DELAY 0xffffffff
+#define pdTRUE 1
+#define pdMS_TO_TICKS(ms) (ms)
+typedef void *TaskHandle_t;
+typedef unsigned int UBaseType_t;
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+BaseType_t xTaskCreatePinnedToCore(void (*task)(void*), const char *name, uint32_t stack, void *param, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+    if (handle) *handle = NULL;
+    return pdTRUE;
+}
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) { return 0; }
+BaseType_t xTaskNotifyGive(TaskHandle_t task) { return pdTRUE; }
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait) { return 0; }
+TickType_t xTaskGetTickCount() { return nativeMillis; }
+void vTaskDelay(TickType_t ticks) {}
+void vTaskDelayUntil(TickType_t *last, TickType_t ticks) {}
+
+struct EspClass {
+    uint32_t getCycleCount() { return 0; }
+    uint32_t getFreeHeap() { return 0; }
+    uint32_t getMinFreeHeap() { return 0; }
+    uint32_t getMaxAllocHeap() { return 0; }
+};
+EspClass ESP;
+uint32_t getCpuFrequencyMhz() { return 240; }
+
+class Print {
+    public:
+        virtual ~Print() {}
+        virtual size_t write(uint8_t c) = 0;
+        virtual size_t write(const uint8_t *buf, size_t len) {
+            size_t n = 0;
+            while (len--) n += write(*buf++);
+            return n;
+        }
+        size_t print(const char *s) { return write((const uint8_t*)s, strlen(s)); }
+        size_t print(long v) { return printf("%ld", v); }
+        size_t println(const char *s = "") { return print(s) + print("\n"); }
+        size_t println(long v) { return print(v) + print("\n"); }
+        size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+            char buf[256];
+            va_list args;
+            va_start(args, format);
+            int len = vsnprintf(buf, sizeof(buf), format, args);
+            va_end(args);
+            return write((const uint8_t*)buf, min(len, (int)sizeof(buf) - 1));
+        }
+};
+
+class Stream : public Print {
+    public:
+        virtual int available() = 0;
+        virtual int read() = 0;
+        virtual int peek() = 0;
+
+        size_t readBytes(char *buffer, size_t length) {
+            size_t n = 0;
+            int c;
+            while (n < length && (c = read()) >= 0) buffer[n++] = (char)c;
+            return n;
+        }
+        bool find(const char *target) { return findUntil(target, NULL); }
+
+        // Read until target is found (true) or terminator or the end of input (false)
+        bool findUntil(const char *target, const char *terminator) {
+            size_t targetLen = strlen(target);
+            size_t termLen = terminator ? strlen(terminator) : 0;
+            size_t t = 0, k = 0;
+            int c;
+            while ((c = read()) >= 0) {
+                t = (c == target[t]) ? t + 1 : (c == target[0]) ? 1 : 0;
+                if (t == targetLen) return true;
+                if (termLen) {
+                    k = (c == terminator[k]) ? k + 1 : (c == terminator[0]) ? 1 : 0;
+                    if (k == termLen) return false;
+                }
+            }
+            return false;
+        }
+};
+
+#include "HardwareSerial.h"
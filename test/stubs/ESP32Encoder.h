@@ -0,0 +1,17 @@
+#pragma once
+#include "Arduino.h"
+
+enum puType { UP, DOWN, NONE };
+
+class ESP32Encoder {
+    public:
+        static puType useInternalWeakPullResistors;
+        void attachHalfQuad(int a, int b) {}
+        void setCount(int64_t value) { count = value; }
+        int64_t getCount() { return count; }
+
+    private:
+        int64_t count = 0;
+};
+
+puType ESP32Encoder::useInternalWeakPullResistors = UP;
@@ -0,0 +1,95 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include "Arduino.h"
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+
+/**
+ * Filesystem stub backed by host files under a root directory,
+ * so "/short.funscript" opens e.g. test/corpus/short.funscript.
+ * setFreeBytes() limits the bytes written from then on, like a full flash.
+ */
+namespace fs {
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+class File : public Stream {
+    public:
+        File() {}
+        File(FILE *f, const char *path, long *freeBytes = NULL) : handle(f, fclose), path(path), freeBytes(freeBytes) { updateSize(); }
+        operator bool() const { return (bool)handle; }
+        bool isDirectory() { return false; }
+        const char *name() { return path.c_str(); }
+        void close() { handle.reset(); }
+        void flush() { if (handle) fflush(handle.get()); }
+        size_t size() { // cached like the ESP32 VFS file, refreshed after writes
+            if (!handle) return 0;
+            if (written) updateSize();
+            return fileSize;
+        }
+        size_t position() { return handle ? ftell(handle.get()) : 0; }
+        bool seek(uint32_t pos, SeekMode mode = SeekSet) { return handle && fseek(handle.get(), pos, mode) == 0; }
+        int available() { return handle ? size() - position() : 0; }
+        int read() { return handle ? fgetc(handle.get()) : -1; }
+        int peek() {
+            if (!handle) return -1;
+            int c = fgetc(handle.get());
+            if (c >= 0) ungetc(c, handle.get());
+            return c;
+        }
+        size_t read(uint8_t *buf, size_t size) { return handle ? fread(buf, 1, size, handle.get()) : 0; }
+        size_t write(uint8_t c) { return write(&c, 1); }
+        size_t write(const uint8_t *buf, size_t size) {
+            if (!handle) return 0;
+            written = true;
+            if (freeBytes && *freeBytes >= 0) {
+                size = min(size, (size_t)*freeBytes);
+                *freeBytes -= size;
+            }
+            return fwrite(buf, 1, size, handle.get());
+        }
+
+    private:
+        std::shared_ptr<FILE> handle;
+        std::string path;
+        size_t fileSize = 0;
+        bool written = false;
+        long *freeBytes = NULL; // owned by the FS
+
+        void updateSize() {
+            struct stat st;
+            fflush(handle.get());
+            fileSize = (fstat(fileno(handle.get()), &st) == 0) ? st.st_size : 0;
+            written = false;
+        }
+};
+
+class FS {
+    public:
+        FS(const char *root = "") : root(root) {}
+        void setRoot(const char *dir) { root = dir; }
+        void setFreeBytes(long bytes) { freeBytes = bytes; } // -1 for no limit
+        File open(const char *path, const char *mode = FILE_READ, bool create = false) {
+            std::string hostPath = root + path;
+            bool writing = mode[0] == 'w';
+            FILE *f = fopen(hostPath.c_str(), writing ? "wb" : "rb");
+            return f ? File(f, path, writing ? &freeBytes : NULL) : File();
+        }
+        bool exists(const char *path) {
+            File f = open(path);
+            return (bool)f;
+        }
+        bool remove(const char *path) { return ::remove((root + path).c_str()) == 0; }
+        bool rename(const char *from, const char *to) { return ::rename((root + from).c_str(), (root + to).c_str()) == 0; }
+
+    private:
+        std::string root;
+        long freeBytes = -1;
+};
+
+} // namespace fs
+
+using fs::File;
@@ -0,0 +1,30 @@
+#pragma once
+#include "Arduino.h"
+
+/**
+ * Serial port stub. The USB serial port prints to stdout, the actuator
+ * and pendant ports count the bytes sent and never receive anything.
+ */
+class HardwareSerial : public Stream {
+    public:
+        HardwareSerial(int uart) : uart(uart) {}
+        void begin(unsigned long baud, uint32_t config = SERIAL_8N1, int8_t rx = -1, int8_t tx = -1) {}
+        operator bool() const { return true; }
+        int available() { return 0; }
+        int read() { return -1; }
+        int peek() { return -1; }
+        size_t write(uint8_t c) {
+            bytesWritten++;
+            if (uart == 0 && !quiet) putchar(c);
+            return 1;
+        }
+        using Print::write;
+
+        uint32_t bytesWritten = 0;
+        bool quiet = false;
+
+    private:
+        int uart;
+};
+
+HardwareSerial Serial(0);
@@ -0,0 +1,46 @@
+#pragma once
+#include <memory>
+#include <string>
+#include "Arduino.h"
+
+/**
+ * Player Storage backend serving one file from RAM, so benchmarks time the
+ * player rather than host file IO.
+ */
+class MemoryFile : public Stream {
+    public:
+        MemoryFile() {}
+        MemoryFile(std::shared_ptr<const std::string> data) : data(data) {}
+        operator bool() const { return (bool)data; }
+        bool isDirectory() { return false; }
+        void close() { data.reset(); pos = 0; }
+        size_t size() { return data ? data->size() : 0; }
+        size_t position() { return pos; }
+        int available() { return size() - pos; }
+        int read() { return (pos < size()) ? (uint8_t)(*data)[pos++] : -1; }
+        int peek() { return (pos < size()) ? (uint8_t)(*data)[pos] : -1; }
+        size_t write(uint8_t c) { return 0; }
+        using Print::write;
+
+    private:
+        std::shared_ptr<const std::string> data;
+        size_t pos = 0;
+};
+
+class MemoryStorage {
+    public:
+        bool load(const char *hostPath) {
+            FILE *f = fopen(hostPath, "rb");
+            if (!f) return false;
+            std::string *s = new std::string();
+            int c;
+            while ((c = fgetc(f)) >= 0) *s += (char)c;
+            fclose(f);
+            data.reset(s);
+            return true;
+        }
+        MemoryFile open(const char *path) { return MemoryFile(data); }
+
+    private:
+        std::shared_ptr<const std::string> data;
+};
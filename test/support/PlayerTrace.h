@@ -0,0 +1,143 @@
+#pragma once
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unity.h>
+#include "NimbleFunscript.h"
+
+#define TRACE_CORPUS_DIR "test/corpus"
+#define TRACE_GOLDEN_DIR "test/golden/"
+#define TRACE_TICK_MS (SEND_INTERVAL / 1000) // ms between packets sent to the actuator
+#define TRACE_TOLERANCE 2 // positionCommand units (-750 to 750) allowed off the golden trace
+#define TRACE_LOOPS_PER_MS 4 // the firmware loop runs many times per ms
+
+// Recorded in each golden trace, the real library defines its version
+#ifdef ARDUINOJSON_VERSION
+#define TRACE_GENERATOR "ArduinoJson " ARDUINOJSON_VERSION
+#else
+#define TRACE_GENERATOR "stand-in ArduinoJson"
+#endif
+#define TRACE_UNCONFIRMED "# generated with stand-in"
+
+/**
+ * Golden trace regression support for the native test env.
+ *
+ * A player is run over a corpus file on the virtual clock, and the
+ * positionCommand of every packet sent to the actuator is recorded.
+ * Traces are compared tick by tick against test/golden/<name>.trace.
+ * Run with UPDATE_GOLDEN=1 set to rewrite the golden traces instead.
+ * Goldens written without the real ArduinoJson are reported as unconfirmed.
+ */
+typedef std::vector<int16_t> Trace;
+
+// Same configuration as the firmware in src/main.cpp
+typedef NimbleFunscriptPlayer<32, LinearInterpolation, NoVibration> TracePlayer;
+
+void resetVirtualDevice()
+{
+    nativeMillis = 0;
+    timerTriggered = 0;
+    actuator = Actuator();
+    actuator.forceCommand = IDLE_FORCE;
+    Serial.quiet = true;
+    SPIFFS.setRoot(TRACE_CORPUS_DIR);
+}
+
+/**
+ * Run the player loop TRACE_LOOPS_PER_MS times every virtual ms for
+ * durationMs, with the actuator timer firing every TRACE_TICK_MS like the
+ * hardware timer does. Calls onLoop(frame) after every loop, if given.
+ */
+template <class Player>
+Trace runTrace(Player &player, unsigned long durationMs, void (*onLoop)(const nimbleFrameState&) = NULL)
+{
+    Trace trace;
+    for (; nativeMillis < durationMs; nativeMillis++) {
+        if (nativeMillis % TRACE_TICK_MS == 0) onTimer();
+        for (int i = 0; i < TRACE_LOOPS_PER_MS; i++) {
+            if (player.updateActuator()) {
+                trace.push_back(actuator.positionCommand);
+            }
+            if (onLoop) onLoop(player.getFrameState());
+        }
+    }
+    return trace;
+}
+
+template <class Player>
+Trace traceFile(Player &player, const char *path, unsigned long durationMs, void (*onLoop)(const nimbleFrameState&) = NULL)
+{
+    resetVirtualDevice();
+    player.initFunscriptFile(SPIFFS, path);
+    player.start();
+    return runTrace(player, durationMs, onLoop);
+}
+
+bool readTrace(const std::string &path, Trace &trace, bool *unconfirmed = NULL)
+{
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f) return false;
+    char line[64];
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') {
+            if (unconfirmed && strncmp(line, TRACE_UNCONFIRMED, strlen(TRACE_UNCONFIRMED)) == 0) *unconfirmed = true;
+            continue;
+        }
+        trace.push_back(atoi(line));
+    }
+    fclose(f);
+    return true;
+}
+
+bool writeTrace(const std::string &path, const Trace &trace)
+{
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f) return false;
+    fprintf(f, "# positionCommand per %d ms packet\n", TRACE_TICK_MS);
+    fprintf(f, "# generated with %s\n", TRACE_GENERATOR);
+    for (size_t i = 0; i < trace.size(); i++) {
+        fprintf(f, "%d\n", trace[i]);
+    }
+    fclose(f);
+    return true;
+}
+
+/**
+ * Index of the first tick further than tolerance from the golden trace,
+ * or -1 if the traces match.
+ */
+long compareTrace(const Trace &actual, const Trace &golden, int tolerance)
+{
+    size_t n = min(actual.size(), golden.size());
+    for (size_t i = 0; i < n; i++) {
+        if (abs(actual[i] - golden[i]) > tolerance) return i;
+    }
+    return (actual.size() == golden.size()) ? -1 : (long)n;
+}
+
+void assertGolden(const char *name, const Trace &trace)
+{
+    std::string path = std::string(TRACE_GOLDEN_DIR) + name + ".trace";
+    if (getenv("UPDATE_GOLDEN")) {
+        TEST_ASSERT_TRUE_MESSAGE(writeTrace(path, trace), path.c_str());
+        return;
+    }
+
+    Trace golden;
+    bool unconfirmed = false;
+    TEST_ASSERT_TRUE_MESSAGE(readTrace(path, golden, &unconfirmed), ("missing golden trace " + path).c_str());
+    if (unconfirmed) {
+        TEST_MESSAGE((path + " was generated with stand-in libraries, confirm it with UPDATE_GOLDEN=1 pio test -e native and review the diff").c_str());
+    }
+    long tick = compareTrace(trace, golden, TRACE_TOLERANCE);
+    if (tick >= 0) {
+        char message[128];
+        snprintf(message, sizeof(message), "%s: tick %ld of %u is %d, golden %d of %u",
+            name, tick, (unsigned)trace.size(),
+            tick < (long)trace.size() ? trace[tick] : 0,
+            tick < (long)golden.size() ? golden[tick] : 0,
+            (unsigned)golden.size());
+        TEST_FAIL_MESSAGE(message);
+    }
+}
@@ -0,0 +1,177 @@
+#pragma once
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "PlayerTrace.h"
+
+#define REPLAY_FORCE_TOLERANCE 2 // forceCommand units (0 to 1023) allowed off the recording
+
+/**
+ * Replay of telemetry logs through the player on the virtual clock.
+ *
+ * A log decoded to CSV with tools/telemetry_decode.py is replayed against
+ * the funscript that was playing: each packet is sent at its recorded time,
+ * with the actuator feedback recorded before it (temp limiting, sensor
+ * fault, presence), and the commands the player sends are compared with the
+ * recorded ones. Stalls in the recording are replayed as stalls.
+ */
+struct ReplayRecord {
+    uint32_t ms = 0;
+    int16_t targetPos = 0;
+    int16_t position = 0;
+    int16_t positionCommand = 0;
+    int16_t forceCommand = 0;
+    int16_t positionFeedback = 0;
+    int16_t forceFeedback = 0;
+    bool tempLimiting = false;
+    bool sensorFault = false;
+    bool present = false;
+};
+typedef std::vector<ReplayRecord> ReplayLog;
+
+static const char *REPLAY_COLUMNS[] = {
+    "session", "segment", "ms", "targetPos", "position", "vibrationPos", "positionCommand",
+    "forceCommand", "positionFeedback", "forceFeedback", "air", "airIn", "airOut",
+    "tempLimiting", "sensorFault", "present"
+};
+static const int REPLAY_COLUMN_COUNT = sizeof(REPLAY_COLUMNS) / sizeof(REPLAY_COLUMNS[0]);
+
+/**
+ * Load one session of a decoded log, the last one if session is negative.
+ */
+bool loadReplay(const char *path, ReplayLog &log, int session = -1)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+
+    // Map the CSV header onto REPLAY_COLUMNS
+    char line[256];
+    int index[REPLAY_COLUMN_COUNT];
+    for (int c = 0; c < REPLAY_COLUMN_COUNT; c++) index[c] = -1;
+    if (fgets(line, sizeof(line), f)) {
+        int field = 0;
+        for (char *name = strtok(line, ",\r\n"); name; name = strtok(NULL, ",\r\n"), field++) {
+            for (int c = 0; c < REPLAY_COLUMN_COUNT; c++) {
+                if (strcmp(name, REPLAY_COLUMNS[c]) == 0) index[c] = field;
+            }
+        }
+    }
+
+    std::vector<int> sessions;
+    ReplayLog all;
+    while (fgets(line, sizeof(line), f)) {
+        long values[REPLAY_COLUMN_COUNT] = {};
+        long fields[REPLAY_COLUMN_COUNT + 8] = {};
+        int n = 0;
+        for (char *p = strtok(line, ",\r\n"); p && n < REPLAY_COLUMN_COUNT + 8; p = strtok(NULL, ",\r\n")) {
+            fields[n++] = atol(p);
+        }
+        for (int c = 0; c < REPLAY_COLUMN_COUNT; c++) {
+            if (index[c] >= 0 && index[c] < n) values[c] = fields[index[c]];
+        }
+        ReplayRecord r;
+        r.ms = values[2];
+        r.targetPos = values[3];
+        r.position = values[4];
+        r.positionCommand = values[6];
+        r.forceCommand = values[7];
+        r.positionFeedback = values[8];
+        r.forceFeedback = values[9];
+        r.tempLimiting = values[13];
+        r.sensorFault = values[14];
+        r.present = values[15];
+        sessions.push_back(values[0]);
+        all.push_back(r);
+    }
+    fclose(f);
+
+    if (all.empty() || index[2] < 0 || index[6] < 0) return false;
+    if (session < 0) session = sessions.back();
+    for (size_t i = 0; i < all.size(); i++) {
+        if (sessions[i] == session) log.push_back(all[i]);
+    }
+    return !log.empty();
+}
+
+/**
+ * Write a log in the decoder's CSV format, as a single session.
+ */
+bool writeReplay(const char *path, const ReplayLog &log)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) return false;
+    for (int c = 0; c < REPLAY_COLUMN_COUNT; c++) {
+        fprintf(f, "%s%s", c ? "," : "", REPLAY_COLUMNS[c]);
+    }
+    fprintf(f, "\n");
+    for (size_t i = 0; i < log.size(); i++) {
+        const ReplayRecord &r = log[i];
+        fprintf(f, "0,0,%u,%d,%d,0,%d,%d,%d,%d,0,0,0,%d,%d,%d\n",
+            (unsigned)r.ms, r.targetPos, r.position, r.positionCommand, r.forceCommand,
+            r.positionFeedback, r.forceFeedback, r.tempLimiting, r.sensorFault, r.present);
+    }
+    fclose(f);
+    return true;
+}
+
+void applyFeedback(const ReplayRecord &r)
+{
+    actuator.positionFeedback = r.positionFeedback;
+    actuator.forceFeedback = r.forceFeedback;
+    actuator.tempLimiting = r.tempLimiting;
+    actuator.sensorFault = r.sensorFault;
+}
+
+ReplayRecord sentRecord(const nimbleFrameState &frame)
+{
+    ReplayRecord r;
+    r.ms = nativeMillis;
+    r.targetPos = frame.targetPos;
+    r.position = frame.position;
+    r.positionCommand = actuator.positionCommand;
+    r.forceCommand = actuator.forceCommand;
+    return r;
+}
+
+/**
+ * Play a script from the start with the recorded packet times and feedback,
+ * returning what the player sent. Without feedback, the actuator never
+ * reports temp limiting.
+ */
+template <class Player>
+ReplayLog replayLog(Player &player, const char *script, const ReplayLog &log, bool feedback = true)
+{
+    resetVirtualDevice();
+    player.initFunscriptFile(SPIFFS, script);
+    player.start();
+
+    ReplayLog sent;
+    for (size_t i = 0; i < log.size(); i++) {
+        unsigned long at = log[i].ms - log[0].ms;
+        for (; nativeMillis < at; nativeMillis++) {
+            for (int l = 0; l < TRACE_LOOPS_PER_MS; l++) player.updateActuator();
+        }
+        if (feedback && i > 0) applyFeedback(log[i - 1]);
+        onTimer();
+        if (!player.updateActuator()) break;
+        sent.push_back(sentRecord(player.getFrameState()));
+    }
+    return sent;
+}
+
+/**
+ * Index of the first packet whose commands differ from the recording beyond
+ * tolerance, or -1 if the replay matches.
+ */
+long compareReplay(const ReplayLog &actual, const ReplayLog &recorded)
+{
+    size_t n = min(actual.size(), recorded.size());
+    for (size_t i = 0; i < n; i++) {
+        if (abs(actual[i].positionCommand - recorded[i].positionCommand) > TRACE_TOLERANCE
+            || abs(actual[i].forceCommand - recorded[i].forceCommand) > REPLAY_FORCE_TOLERANCE) {
+            return i;
+        }
+    }
+    return (actual.size() == recorded.size()) ? -1 : (long)n;
+}
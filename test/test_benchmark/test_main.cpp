@@ -0,0 +1,272 @@
+#include <chrono>
+#include <cxxabi.h>
+#include <typeinfo>
+#include <unistd.h>
+#include <unity.h>
+#include "PlayerTrace.h"
+#include "MemoryStorage.h"
+
+/**
+ * Per-tick time of the playback pipeline for different player
+ * instantiations, on the host. Relative numbers only, the device is
+ * profiled with the "profile" env. Code size is read from this program's
+ * symbols with nm, as tools/player_sizes.py does for any build: the bytes of
+ * every function whose name contains the instantiation.
+ *
+ * Also compares the control loop's LED update before and after LedRenderer.
+ * On the host each ledcWrite() call busy-waits BENCH_LEDC_WRITE_NS, a
+ * model of the device's PWM update rather than a measurement of it; the
+ * "leds" row of the profile env times the LED update on the device.
+ */
+
+#define BENCH_FILE TRACE_CORPUS_DIR "/huge.funscript"
+#define BENCH_MS 30000 // virtual ms played
+#define BENCH_RUNS 5 // best of
+#define BENCH_LED_REPEAT 100 // LED updates timed per frame
+#define BENCH_LEDC_WRITE_NS 1000 // assumed ledcWrite() cost, ledc_set_duty() + ledc_update_duty() in the IDF
+
+typedef NimbleFunscriptPlayer<32, LinearInterpolation, NoVibration> FirmwarePlayer;
+typedef NimbleFunscriptPlayer<> DefaultPlayer;
+typedef NimbleFunscriptPlayer<32, CosineInterpolation, SineVibration> CosinePlayer;
+typedef NimbleFunscriptPlayer<32, LinearInterpolation, NoVibration, DeltaLimiter<>, fs::FS, NoDerating> MinimalPlayer;
+typedef NimbleFunscriptPlayer<128, LinearInterpolation, NoVibration> LargeBufferPlayer;
+typedef NimbleFunscriptPlayer<32, LinearInterpolation, NoVibration, DeltaLimiter<>, MemoryStorage> MemoryPlayer;
+
+MemoryStorage memoryStorage;
+
+struct Symbol {
+    std::string name;
+    unsigned long size;
+};
+std::vector<Symbol> symbols;
+
+/**
+ * Load this program's function symbols, demangled, with their sizes.
+ */
+void loadSymbols()
+{
+    char cmd[64], line[1024];
+    snprintf(cmd, sizeof(cmd), "nm -C -S /proc/%d/exe 2>/dev/null", (int)getpid());
+    FILE *nm = popen(cmd, "r");
+    if (!nm) return;
+    while (fgets(line, sizeof(line), nm)) {
+        char type, name[1024];
+        unsigned long address, size;
+        if (sscanf(line, "%lx %lx %c %1023[^\n]", &address, &size, &type, name) == 4 && strchr("tTwW", type)) {
+            Symbol symbol = { name, size };
+            symbols.push_back(symbol);
+        }
+    }
+    pclose(nm);
+}
+
+/**
+ * Code bytes of an instantiation, or 0 if nm is not available.
+ */
+template <class Player>
+unsigned long codeSize()
+{
+    char *demangled = abi::__cxa_demangle(typeid(Player).name(), NULL, NULL, NULL);
+    if (!demangled) return 0;
+    std::string player = demangled;
+    free(demangled);
+
+    unsigned long size = 0;
+    for (size_t i = 0; i < symbols.size(); i++) {
+        if (symbols[i].name.find(player) != std::string::npos) size += symbols[i].size;
+    }
+    return size;
+}
+
+template <class Player>
+__attribute__((noinline)) bool tick(Player &player)
+{
+    return player.updateActuator();
+}
+
+template <class Player, class Storage>
+double benchTick(Storage &storage, Trace &trace)
+{
+    double best = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        Player player;
+        resetVirtualDevice();
+        player.initFunscriptFile(storage, "/huge.funscript");
+        player.start();
+        trace.clear();
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (; nativeMillis < BENCH_MS; nativeMillis++) {
+            if (nativeMillis % TRACE_TICK_MS == 0) onTimer();
+            for (int i = 0; i < TRACE_LOOPS_PER_MS; i++) {
+                if (tick(player)) trace.push_back(actuator.positionCommand);
+            }
+        }
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        double perTick = ns / trace.size();
+        if (run == 0 || perTick < best) best = perTick;
+    }
+    return best;
+}
+
+template <class Player, class Storage>
+void report(const char *name, Storage &storage, Trace &trace)
+{
+    double ns = benchTick<Player>(storage, trace);
+    char line[128];
+    snprintf(line, sizeof(line), "%-36s %8.0f ns/tick %7lu %6u", name, ns, codeSize<Player>(), (unsigned)sizeof(Player));
+    TEST_MESSAGE(line);
+}
+
+/**
+ * updateEncoderLEDs() and updateHardwareLEDs() as the control loop ran them
+ * every LED_FRAME_MS before LedRenderer, with vibration compiled out.
+ */
+void legacyUpdateLEDs(const nimbleFrameState &frame)
+{
+    byte ledScale = map(abs(frame.lastPos), 0, ACTUATOR_MAX_POS, 1, LED_MAX_DUTY);
+    byte ledState1 = (frame.lastPos < 0) ? ledScale : 0;
+    byte ledState2 = (frame.lastPos > 0) ? ledScale : 0;
+    ledcWrite(ENC_LED_N,  ledState1);
+    ledcWrite(ENC_LED_SE, ledState1);
+    ledcWrite(ENC_LED_SW, ledState1);
+    ledcWrite(ENC_LED_NE, ledState2);
+    ledcWrite(ENC_LED_NW, ledState2);
+    ledcWrite(ENC_LED_S,  ledState2);
+    ledcWrite(ENC_LED_W, 0);
+    ledcWrite(ENC_LED_E, 0);
+    ledcWrite(PEND_LED, (pendant.present) ? LED_HARDWARE_DUTY : 0);
+    ledcWrite(ACT_LED, (actuator.present) ? LED_HARDWARE_DUTY : 0);
+}
+
+LedRenderer leds;
+LedState ledState;
+
+__attribute__((noinline)) void legacyLEDs(FirmwarePlayer &player)
+{
+    legacyUpdateLEDs(player.getFrameState());
+}
+
+__attribute__((noinline)) void publishLEDs(FirmwarePlayer &player)
+{
+    player.getLedState(ledState);
+    leds.publish(ledState);
+}
+
+struct LedBench {
+    double ns; // host time per update on the control loop
+    double renderNs; // host time per frame on the render task
+    uint32_t loopWrites; // ledcWrite() calls on the control loop
+    uint32_t renderWrites; // ledcWrite() calls on the render task
+    uint32_t updates;
+};
+
+double elapsedNs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+LedBench benchLEDs(void (*update)(FirmwarePlayer&), long writeNs)
+{
+    FirmwarePlayer player;
+    resetVirtualDevice();
+    actuator.present = true;
+    leds.init();
+    player.initFunscriptFile(SPIFFS, "/huge.funscript");
+    player.start();
+    nativeLedcWriteNs = writeNs;
+    LedBench bench = { 0, 0, 0, 0, 0 };
+    for (; nativeMillis < BENCH_MS; nativeMillis++) {
+        if (nativeMillis % TRACE_TICK_MS == 0) onTimer();
+        player.updateActuator();
+        if (nativeMillis % LED_FRAME_MS) continue;
+
+        uint32_t writes = nativeLedcWrites;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < BENCH_LED_REPEAT; i++) update(player);
+        bench.ns += elapsedNs(start) / BENCH_LED_REPEAT;
+        bench.loopWrites += (nativeLedcWrites - writes) / BENCH_LED_REPEAT;
+        bench.updates++;
+
+        // On the render task in the firmware
+        writes = nativeLedcWrites;
+        start = std::chrono::steady_clock::now();
+        leds.renderFrame();
+        bench.renderNs += elapsedNs(start);
+        bench.renderWrites += nativeLedcWrites - writes;
+    }
+    nativeLedcWriteNs = 0;
+    bench.ns /= bench.updates;
+    bench.renderNs /= bench.updates;
+    return bench;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_instantiations()
+{
+    Trace firmware, fallback, cosine, minimal, large, memory;
+    loadSymbols();
+    TEST_MESSAGE("player                                 host time       code object (bytes)");
+    report<FirmwarePlayer>("<32, Linear, NoVibration> (firmware)", SPIFFS, firmware);
+    report<DefaultPlayer>("<32, Linear, SineVibration>", SPIFFS, fallback);
+    report<CosinePlayer>("<32, Cosine, SineVibration>", SPIFFS, cosine);
+    report<MinimalPlayer>("<32, Linear, NoVibration, NoDerating>", SPIFFS, minimal);
+    report<LargeBufferPlayer>("<128, Linear, NoVibration>", SPIFFS, large);
+    TEST_ASSERT_TRUE(memoryStorage.load(BENCH_FILE));
+    report<MemoryPlayer>("<32, Linear, NoVibration, Memory>", memoryStorage, memory);
+
+    // Compiling out a feature that is off, or changing the storage, must not change the motion
+    TEST_ASSERT_EQUAL(BENCH_MS / TRACE_TICK_MS, firmware.size());
+    TEST_ASSERT_EQUAL(-1, compareTrace(fallback, firmware, 0));
+    TEST_ASSERT_EQUAL(-1, compareTrace(minimal, firmware, 0));
+    TEST_ASSERT_EQUAL(-1, compareTrace(large, firmware, 0));
+    TEST_ASSERT_EQUAL(-1, compareTrace(memory, firmware, 0));
+    TEST_ASSERT_TRUE(compareTrace(cosine, firmware, 0) >= 0);
+
+    if (symbols.empty()) {
+        TEST_MESSAGE("no code sizes: nm not found, use tools/player_sizes.py on the build");
+    } else {
+        // Each instantiation is compiled separately
+        TEST_ASSERT_TRUE(codeSize<FirmwarePlayer>() > 0);
+        TEST_ASSERT_TRUE(codeSize<MemoryPlayer>() > 0);
+    }
+}
+
+void test_led_update()
+{
+    const char *env = getenv("BENCH_LEDC_WRITE_NS");
+    long writeNs = env ? atol(env) : BENCH_LEDC_WRITE_NS;
+    LedBench before = benchLEDs(legacyLEDs, writeNs);
+    LedBench after = benchLEDs(publishLEDs, writeNs);
+    LedBench beforeFree = benchLEDs(legacyLEDs, 0);
+    LedBench afterFree = benchLEDs(publishLEDs, 0);
+
+    char line[160];
+    snprintf(line, sizeof(line), "LED update, host time per frame    ledcWrite %ld ns   free ledcWrite   ledcWrite calls", writeNs);
+    TEST_MESSAGE(line);
+    snprintf(line, sizeof(line), "%-36s %11.0f ns %13.0f ns %8.1f", "before: control loop", before.ns, beforeFree.ns,
+        (double)before.loopWrites / before.updates);
+    TEST_MESSAGE(line);
+    snprintf(line, sizeof(line), "%-36s %11.0f ns %13.0f ns %8.1f", "after: control loop", after.ns, afterFree.ns,
+        (double)after.loopWrites / after.updates);
+    TEST_MESSAGE(line);
+    snprintf(line, sizeof(line), "%-36s %11.0f ns %13.0f ns %8.1f", "after: render task", after.renderNs, afterFree.renderNs,
+        (double)after.renderWrites / after.updates);
+    TEST_MESSAGE(line);
+
+    TEST_ASSERT_EQUAL(10 * before.updates, before.loopWrites);
+    TEST_ASSERT_EQUAL(0, after.loopWrites);
+    TEST_ASSERT_TRUE(after.renderWrites < before.loopWrites);
+    // Only meaningful with the PWM writes costing what they do on the device
+    if (writeNs >= BENCH_LEDC_WRITE_NS) TEST_ASSERT_TRUE(after.ns < before.ns);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_instantiations);
+    RUN_TEST(test_led_update);
+    return UNITY_END();
+}
@@ -0,0 +1,365 @@
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <unity.h>
+#include "FunscriptImporter.h"
+
+/**
+ * Funscript importer and keyframe decimator, run through the fs stub in a
+ * temporary directory.
+ */
+
+#define CORPUS_DIR "test/corpus/"
+
+FunscriptImporter importer;
+fs::FS importFs;
+std::string importDir;
+
+void setUp()
+{
+    char dir[] = "/tmp/nimble_import_XXXXXX";
+    TEST_ASSERT_TRUE(mkdtemp(dir) != NULL);
+    importDir = dir;
+    importFs.setRoot(dir);
+    importFs.setFreeBytes(-1);
+    Serial.quiet = true;
+}
+
+void tearDown()
+{
+    system(("rm -rf " + importDir).c_str());
+}
+
+std::string readFile(const char *path)
+{
+    std::string data;
+    File f = importFs.open(path);
+    int c;
+    while (f && (c = f.read()) >= 0) data += (char)c;
+    return data;
+}
+
+void writeFile(const char *path, const std::string &data)
+{
+    File f = importFs.open(path, FILE_WRITE);
+    f.write((const uint8_t*)data.data(), data.size());
+}
+
+std::string readHostFile(const char *path)
+{
+    std::string data;
+    FILE *f = fopen(path, "rb");
+    int c;
+    while (f && (c = fgetc(f)) >= 0) data += (char)c;
+    if (f) fclose(f);
+    return data;
+}
+
+std::string funscript(const std::vector<FunscriptAction> &actions, const char *extra = "")
+{
+    std::string s = "{\"version\":\"1.0\",\"actions\":[";
+    char buf[40];
+    for (size_t i = 0; i < actions.size(); i++) {
+        snprintf(buf, sizeof(buf), "%s{\"at\":%d,\"pos\":%d}", i ? "," : "", (int)actions[i].at, (int)actions[i].pos);
+        s += buf;
+    }
+    return s + "]" + extra + "}";
+}
+
+std::vector<FunscriptAction> parseActions(const std::string &data)
+{
+    std::vector<FunscriptAction> actions;
+    size_t p = data.find("\"actions\":[");
+    while ((p = data.find("{\"at\":", p)) != std::string::npos) {
+        FunscriptAction a;
+        int at, pos;
+        if (sscanf(data.c_str() + p, "{\"at\":%d,\"pos\":%d}", &at, &pos) != 2) break;
+        a.at = at;
+        a.pos = pos;
+        actions.push_back(a);
+        p++;
+    }
+    return actions;
+}
+
+FunscriptAction action(int32_t at, int16_t pos)
+{
+    FunscriptAction a;
+    a.at = at;
+    a.pos = pos;
+    return a;
+}
+
+/**
+ * Check that kept is sorted, made of actions from expected, starts and ends
+ * with it, and passes within DECIMATE_TOLERANCE of every expected action.
+ */
+void assertDecimated(const std::map<int32_t, int16_t> &expected, const std::vector<FunscriptAction> &kept)
+{
+    TEST_ASSERT_TRUE(kept.size() >= 2);
+    TEST_ASSERT_EQUAL(expected.begin()->first, kept.front().at);
+    TEST_ASSERT_EQUAL(expected.rbegin()->first, kept.back().at);
+    for (size_t i = 0; i < kept.size(); i++) {
+        if (i > 0) TEST_ASSERT_TRUE(kept[i].at > kept[i - 1].at);
+        std::map<int32_t, int16_t>::const_iterator e = expected.find(kept[i].at);
+        TEST_ASSERT_TRUE(e != expected.end());
+        TEST_ASSERT_EQUAL(e->second, kept[i].pos);
+    }
+
+    size_t k = 0;
+    for (std::map<int32_t, int16_t>::const_iterator e = expected.begin(); e != expected.end(); ++e) {
+        while (k + 1 < kept.size() && kept[k + 1].at < e->first) k++;
+        const FunscriptAction &a = kept[k];
+        const FunscriptAction &b = kept[min(k + 1, kept.size() - 1)];
+        float lerp = (b.at == a.at) ? a.pos : a.pos + float(b.pos - a.pos) * (e->first - a.at) / (b.at - a.at);
+        TEST_ASSERT_FLOAT_WITHIN(DECIMATE_TOLERANCE + 0.001, e->second, lerp);
+    }
+}
+
+// More actions than one merge pass takes, shuffled, with repeated and negative times
+void test_sort_multipass()
+{
+    srand(1);
+    std::vector<FunscriptAction> actions;
+    for (int i = 0; i < 4000; i++) actions.push_back(action(i * 10, rand() % 101));
+    for (int i = 0; i < 1000; i++) actions.push_back(action((rand() % 4000) * 10, rand() % 101));
+    for (int i = 0; i < 50; i++) actions.push_back(action(-1 - rand() % 1000, 50));
+    actions.push_back(action(40000, -20)); // clamped to 0
+    actions.push_back(action(40010, 130)); // clamped to 100
+    for (size_t i = actions.size() - 1; i > 0; i--) {
+        size_t j = rand() % (i + 1);
+        FunscriptAction t = actions[i];
+        actions[i] = actions[j];
+        actions[j] = t;
+    }
+    TEST_ASSERT_TRUE(actions.size() > IMPORT_RUN_ACTIONS * IMPORT_MAX_RUNS);
+
+    // The last action in the file wins for a repeated time
+    std::map<int32_t, int16_t> expected;
+    for (size_t i = 0; i < actions.size(); i++) {
+        if (actions[i].at >= 0) expected[actions[i].at] = min(max(actions[i].pos, (int16_t)0), (int16_t)100);
+    }
+
+    writeFile("/big.funscript", funscript(actions));
+    TEST_ASSERT_TRUE(importer.import(importFs, "/big.funscript"));
+    std::string data = readFile("/big.funscript");
+    TEST_ASSERT_EQUAL(0, data.compare(0, strlen(IMPORT_HEADER), IMPORT_HEADER));
+    assertDecimated(expected, parseActions(data));
+
+    TEST_ASSERT_FALSE(importFs.exists(IMPORT_SCRATCH_A));
+    TEST_ASSERT_FALSE(importFs.exists(IMPORT_SCRATCH_B));
+    TEST_ASSERT_FALSE(importFs.exists(IMPORT_TMP));
+    TEST_ASSERT_FALSE(importFs.exists(IMPORT_JOURNAL));
+}
+
+// Equal timestamps in one run, and across runs merged in the same pass
+void test_sort_last_wins()
+{
+    std::vector<FunscriptAction> actions;
+    actions.push_back(action(100, 10));
+    actions.push_back(action(0, 0));
+    actions.push_back(action(100, 90));
+    for (int i = 0; i < IMPORT_RUN_ACTIONS; i++) actions.push_back(action(1000 + i * 100, i % 2 ? 0 : 100));
+    actions.push_back(action(100, 40)); // next run
+    writeFile("/dup.funscript", funscript(actions));
+    TEST_ASSERT_TRUE(importer.import(importFs, "/dup.funscript"));
+
+    std::vector<FunscriptAction> kept = parseActions(readFile("/dup.funscript"));
+    TEST_ASSERT_EQUAL(0, kept[0].at);
+    TEST_ASSERT_EQUAL(100, kept[1].at);
+    TEST_ASSERT_EQUAL(40, kept[1].pos);
+    TEST_ASSERT_EQUAL(1000, kept[2].at);
+}
+
+// Clean files, even with a few collinear actions, are not rewritten
+void test_clean_files_untouched()
+{
+    const char *names[] = { "short", "dense", "huge", "heavy" };
+    for (const char *name : names) {
+        std::string original = readHostFile((std::string(CORPUS_DIR) + name + ".funscript").c_str());
+        std::string path = std::string("/") + name + ".funscript";
+        writeFile(path.c_str(), original);
+        TEST_ASSERT_TRUE(importer.import(importFs, path.c_str()));
+        TEST_ASSERT_TRUE_MESSAGE(readFile(path.c_str()) == original, name);
+    }
+}
+
+std::vector<FunscriptAction> rampActions()
+{
+    std::vector<FunscriptAction> actions;
+    for (int i = 0; i < 500; i++) actions.push_back(action(i * 10, (i % 50) * 2));
+    return actions;
+}
+
+// Over-dense sorted files are decimated in place, keeping their other properties
+void test_decimate_keeps_properties()
+{
+    std::vector<FunscriptAction> actions = rampActions();
+    writeFile("/ramp.funscript", funscript(actions, ",\"metadata\":{\"title\":\"ramp\"}"));
+    TEST_ASSERT_TRUE(importer.import(importFs, "/ramp.funscript"));
+
+    std::string data = readFile("/ramp.funscript");
+    TEST_ASSERT_EQUAL(0, data.compare(0, strlen(IMPORT_MARKER "\"version\":\"1.0\""), IMPORT_MARKER "\"version\":\"1.0\""));
+    TEST_ASSERT_TRUE(data.find("],\"metadata\":{\"title\":\"ramp\"}}") != std::string::npos);
+    std::vector<FunscriptAction> kept = parseActions(data);
+    TEST_ASSERT_TRUE(kept.size() < actions.size() / 10);
+    std::map<int32_t, int16_t> expected;
+    for (size_t i = 0; i < actions.size(); i++) expected[actions[i].at] = actions[i].pos;
+    assertDecimated(expected, kept);
+
+    // Imported files are not decimated again
+    TEST_ASSERT_TRUE(importer.import(importFs, "/ramp.funscript"));
+    TEST_ASSERT_TRUE(readFile("/ramp.funscript") == data);
+}
+
+// Decimation is optional: with the flash full, the original is kept and played
+void test_decimate_failure_keeps_original()
+{
+    std::string original = funscript(rampActions());
+    writeFile("/ramp.funscript", original);
+    importFs.setFreeBytes(100);
+    TEST_ASSERT_TRUE(importer.import(importFs, "/ramp.funscript"));
+    TEST_ASSERT_TRUE(readFile("/ramp.funscript") == original);
+    TEST_ASSERT_FALSE(importFs.exists(IMPORT_TMP));
+}
+
+// A file that needs sorting but can't be rewritten is not played
+void test_sort_failure_fails_closed()
+{
+    std::vector<FunscriptAction> actions;
+    actions.push_back(action(500, 100));
+    actions.push_back(action(0, 0));
+    std::string original = funscript(actions);
+    writeFile("/unsorted.funscript", original);
+    importFs.setFreeBytes(10);
+    TEST_ASSERT_FALSE(importer.import(importFs, "/unsorted.funscript"));
+    TEST_ASSERT_TRUE(readFile("/unsorted.funscript") == original);
+    TEST_ASSERT_FALSE(importFs.exists(IMPORT_SCRATCH_A));
+    TEST_ASSERT_FALSE(importFs.exists(IMPORT_TMP));
+}
+
+// Power lost after the original was removed, before the rename
+void test_recover_after_remove()
+{
+    writeFile(IMPORT_TMP, "new");
+    writeFile(IMPORT_JOURNAL, "/a.funscript");
+    writeFile(IMPORT_SCRATCH_A, "runs");
+    importer.recover(importFs);
+    TEST_ASSERT_TRUE(readFile("/a.funscript") == "new");
+    TEST_ASSERT_FALSE(importFs.exists(IMPORT_TMP));
+    TEST_ASSERT_FALSE(importFs.exists(IMPORT_JOURNAL));
+    TEST_ASSERT_FALSE(importFs.exists(IMPORT_SCRATCH_A));
+}
+
+// Power lost before the original was removed
+void test_recover_before_remove()
+{
+    writeFile("/a.funscript", "old");
+    writeFile(IMPORT_TMP, "new");
+    writeFile(IMPORT_JOURNAL, "/a.funscript");
+    importer.recover(importFs);
+    TEST_ASSERT_TRUE(readFile("/a.funscript") == "new");
+    TEST_ASSERT_FALSE(importFs.exists(IMPORT_JOURNAL));
+}
+
+// Power lost after the rename, before the journal was removed
+void test_recover_after_rename()
+{
+    writeFile("/a.funscript", "new");
+    writeFile(IMPORT_JOURNAL, "/a.funscript");
+    importer.recover(importFs);
+    TEST_ASSERT_TRUE(readFile("/a.funscript") == "new");
+    TEST_ASSERT_FALSE(importFs.exists(IMPORT_JOURNAL));
+}
+
+// An import that never finished writing leaves the original alone
+void test_recover_unfinished_import()
+{
+    writeFile("/a.funscript", "old");
+    writeFile(IMPORT_TMP, "partial");
+    importer.recover(importFs);
+    TEST_ASSERT_TRUE(readFile("/a.funscript") == "old");
+    TEST_ASSERT_FALSE(importFs.exists(IMPORT_TMP));
+}
+
+// No repairs while an earlier one waits to be recovered
+void test_import_waits_for_recovery()
+{
+    std::vector<FunscriptAction> actions;
+    actions.push_back(action(500, 100));
+    actions.push_back(action(0, 0));
+    writeFile("/unsorted.funscript", funscript(actions));
+    writeFile("/ramp.funscript", funscript(rampActions()));
+    writeFile(IMPORT_JOURNAL, "/a.funscript");
+    writeFile(IMPORT_TMP, "new");
+    TEST_ASSERT_FALSE(importer.import(importFs, "/unsorted.funscript"));
+    TEST_ASSERT_TRUE(importer.import(importFs, "/ramp.funscript"));
+    TEST_ASSERT_TRUE(readFile(IMPORT_TMP) == "new");
+}
+
+// Every removed action is within tolerance, on noisy input
+void test_decimator_tolerance()
+{
+    KeyframeDecimator decimator;
+    std::map<int32_t, int16_t> expected;
+    std::vector<FunscriptAction> kept;
+    FunscriptAction k;
+    srand(2);
+    for (int i = 0; i < 2000; i++) {
+        FunscriptAction a = action(i * 5, 50 + round(45 * sin(i / 40.0)) + rand() % 2);
+        expected[a.at] = a.pos;
+        if (decimator.push(a, k)) kept.push_back(k);
+    }
+    if (decimator.finish(k)) kept.push_back(k);
+    TEST_ASSERT_EQUAL(2000, decimator.actionsIn);
+    TEST_ASSERT_EQUAL(kept.size(), decimator.actionsKept);
+    TEST_ASSERT_TRUE(kept.size() < 1000);
+    TEST_ASSERT_TRUE(decimator.maxDeviation <= DECIMATE_TOLERANCE);
+    assertDecimated(expected, kept);
+}
+
+// A straight line is still cut every DECIMATE_WINDOW actions, and finish() ends it
+void test_decimator_window()
+{
+    KeyframeDecimator decimator;
+    std::vector<int> keptIndex;
+    FunscriptAction k;
+    const int n = 200;
+    for (int i = 0; i < n; i++) {
+        if (decimator.push(action(i * 10, i / 2), k)) keptIndex.push_back(k.at / 10);
+    }
+    TEST_ASSERT_TRUE(decimator.finish(k));
+    keptIndex.push_back(k.at / 10);
+    TEST_ASSERT_FALSE(decimator.finish(k));
+
+    TEST_ASSERT_EQUAL(0, keptIndex.front());
+    TEST_ASSERT_EQUAL(n - 1, keptIndex.back());
+    for (size_t i = 1; i < keptIndex.size(); i++) {
+        TEST_ASSERT_TRUE(keptIndex[i] - keptIndex[i - 1] <= DECIMATE_WINDOW);
+    }
+    TEST_ASSERT_TRUE(keptIndex.size() <= n / DECIMATE_WINDOW + 2);
+
+    // Nothing to flush without input
+    decimator.reset();
+    TEST_ASSERT_FALSE(decimator.finish(k));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_sort_multipass);
+    RUN_TEST(test_sort_last_wins);
+    RUN_TEST(test_clean_files_untouched);
+    RUN_TEST(test_decimate_keeps_properties);
+    RUN_TEST(test_decimate_failure_keeps_original);
+    RUN_TEST(test_sort_failure_fails_closed);
+    RUN_TEST(test_recover_after_remove);
+    RUN_TEST(test_recover_before_remove);
+    RUN_TEST(test_recover_after_rename);
+    RUN_TEST(test_recover_unfinished_import);
+    RUN_TEST(test_import_waits_for_recovery);
+    RUN_TEST(test_decimator_tolerance);
+    RUN_TEST(test_decimator_window);
+    return UNITY_END();
+}
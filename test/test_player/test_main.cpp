@@ -0,0 +1,122 @@
+#include <unity.h>
+#include "PlayerTrace.h"
+
+/**
+ * Golden trace regression tests for the playback pipeline
+ * (parse, interpolation, delta limiter, packet encoding).
+ */
+
+const char *playlist[] = { "/short.funscript", "/malformed_noactions.funscript", "/dense.funscript" };
+int playlistIndex = 0;
+
+const char *nextPlaylistFile()
+{
+    return (playlistIndex < 3) ? playlist[playlistIndex++] : NULL;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_short()
+{
+    TracePlayer player;
+    assertGolden("short", traceFile(player, "/short.funscript", 3500));
+}
+
+// Actions every 10 ms, moving faster than the delta limiter allows
+void test_dense()
+{
+    TracePlayer player;
+    assertGolden("dense", traceFile(player, "/dense.funscript", 4500));
+}
+
+// Many times the keyframe buffer, after a large metadata block
+void test_huge()
+{
+    TracePlayer player;
+    assertGolden("huge", traceFile(player, "/huge.funscript", 32000));
+}
+
+// Plays the actions before the parse error, then holds
+void test_malformed_truncated()
+{
+    TracePlayer player;
+    assertGolden("malformed_truncated", traceFile(player, "/malformed_truncated.funscript", 2500));
+}
+
+void test_malformed_garbage()
+{
+    TracePlayer player;
+    assertGolden("malformed_garbage", traceFile(player, "/malformed_garbage.funscript", 2500));
+}
+
+// Nothing to play, the actuator stays where it is
+void test_malformed_noactions()
+{
+    TracePlayer player;
+    Trace trace = traceFile(player, "/malformed_noactions.funscript", 1000);
+    TEST_ASSERT_EQUAL(500, trace.size());
+    for (size_t i = 0; i < trace.size(); i++) {
+        TEST_ASSERT_EQUAL(0, trace[i]);
+    }
+}
+
+// Repeated timestamps, as left by a failed import, never target out of range
+int16_t maxTarget = 0;
+
+void trackMaxTarget(const nimbleFrameState &frame)
+{
+    maxTarget = max(maxTarget, (int16_t)abs(frame.targetPos));
+}
+
+void test_malformed_duplicate()
+{
+    TracePlayer player;
+    maxTarget = 0;
+    Trace trace = traceFile(player, "/malformed_duplicate.funscript", 2500, trackMaxTarget);
+    TEST_ASSERT_TRUE(maxTarget <= ACTUATOR_MAX_POS);
+    assertGolden("malformed_duplicate", trace);
+}
+
+void test_malformed_empty()
+{
+    TracePlayer player;
+    assertGolden("malformed_empty", traceFile(player, "/malformed_empty.funscript", 1000));
+}
+
+// Gapless stitching, skipping a file with nothing to play
+void test_playlist()
+{
+    TracePlayer player;
+    playlistIndex = 0;
+    player.setNextFileHandler(nextPlaylistFile);
+    assertGolden("playlist", traceFile(player, nextPlaylistFile(), 8500));
+}
+
+// The comparison itself: within tolerance passes, beyond it or a length change fails
+void test_compare_tolerance()
+{
+    Trace golden = { 0, 10, 20, 30 };
+    Trace close = { 1, 8, 20, 32 };
+    Trace off = { 0, 10, 23, 30 };
+    Trace shorter = { 0, 10, 20 };
+    TEST_ASSERT_EQUAL(-1, compareTrace(close, golden, TRACE_TOLERANCE));
+    TEST_ASSERT_EQUAL(2, compareTrace(off, golden, TRACE_TOLERANCE));
+    TEST_ASSERT_EQUAL(3, compareTrace(shorter, golden, TRACE_TOLERANCE));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_compare_tolerance);
+    RUN_TEST(test_short);
+    RUN_TEST(test_dense);
+    RUN_TEST(test_huge);
+    RUN_TEST(test_malformed_truncated);
+    RUN_TEST(test_malformed_garbage);
+    RUN_TEST(test_malformed_noactions);
+    RUN_TEST(test_malformed_duplicate);
+    RUN_TEST(test_malformed_empty);
+    RUN_TEST(test_playlist);
+    return UNITY_END();
+}
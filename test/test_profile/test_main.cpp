@@ -0,0 +1,56 @@
+#define PROFILE
+#include <unity.h>
+#include "PlayerTrace.h"
+
+/**
+ * Per-stage timing of the playback pipeline on the host, over the corpus.
+ * Relative numbers only, the device is profiled with the "profile" env.
+ */
+
+struct ProfiledFile {
+    const char *path;
+    unsigned long durationMs;
+    uint32_t actions;
+};
+
+const ProfiledFile corpus[] = {
+    { "/short.funscript", 3500, 6 },
+    { "/dense.funscript", 4500, 300 },
+    { "/huge.funscript", 32000, 1200 },
+};
+
+void setUp() { profiler.reset(); }
+void tearDown() {}
+
+void profileFile(const ProfiledFile &file)
+{
+    TracePlayer player;
+    traceFile(player, file.path, file.durationMs);
+
+    Serial.quiet = false;
+    Serial.printf("-- %s --\n", file.path);
+    profiler.print();
+    Serial.quiet = true;
+
+    // Every keyframe is parsed once, and each stage ran
+    TEST_ASSERT_EQUAL(file.actions, profiler.getKeyframes());
+    ProfileStage stages[] = { STAGE_PARSE, STAGE_LERP, STAGE_VIBRATION, STAGE_CLAMP, STAGE_ENCODE };
+    for (ProfileStage stage : stages) {
+        TEST_ASSERT_TRUE(profiler.getStats(stage).calls > 0);
+        TEST_ASSERT_TRUE(profiler.getStats(stage).cycles > 0);
+    }
+    TEST_ASSERT_EQUAL(file.durationMs / TRACE_TICK_MS, profiler.getStats(STAGE_ENCODE).calls);
+}
+
+void test_profile_short() { profileFile(corpus[0]); }
+void test_profile_dense() { profileFile(corpus[1]); }
+void test_profile_huge() { profileFile(corpus[2]); }
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_profile_short);
+    RUN_TEST(test_profile_dense);
+    RUN_TEST(test_profile_huge);
+    return UNITY_END();
+}
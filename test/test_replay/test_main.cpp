@@ -0,0 +1,113 @@
+#include <unity.h>
+#include "TelemetryReplay.h"
+
+/**
+ * Replays a decoded telemetry log through the player and compares the
+ * commands sent with the recorded ones.
+ *
+ * By default a sample log of heavy.funscript is replayed. To replay a log
+ * from the device, decode it to CSV and point the test at it and at the
+ * funscript that was playing:
+ *   REPLAY_LOG=session.csv REPLAY_SCRIPT=data/example.funscript pio test -e native -f test_replay
+ * REPLAY_SESSION picks a session, the last one by default. Run with
+ * UPDATE_GOLDEN=1 set to regenerate the sample log.
+ */
+
+#define SAMPLE_LOG "test/corpus/heavy.telemetry.csv"
+#define SAMPLE_SCRIPT "/heavy.funscript"
+#define SAMPLE_MS 6000
+#define SAMPLE_LIMITING_START 3000 // actuator reports temp limiting in this window
+#define SAMPLE_LIMITING_END 5000
+#define SAMPLE_STALL_START 4000 // control loop stalled, like on a flash erase
+#define SAMPLE_STALL_END 4030
+
+/**
+ * Record a sample log on the host, as the firmware would on the device,
+ * with a temp limiting window and a control loop stall.
+ */
+ReplayLog recordSample()
+{
+    TracePlayer player;
+    resetVirtualDevice();
+    player.initFunscriptFile(SPIFFS, SAMPLE_SCRIPT);
+    player.start();
+
+    ReplayLog log;
+    for (; nativeMillis < SAMPLE_MS; nativeMillis++) {
+        if (nativeMillis % TRACE_TICK_MS == 0) onTimer();
+        if (nativeMillis >= SAMPLE_STALL_START && nativeMillis < SAMPLE_STALL_END) continue;
+        for (int i = 0; i < TRACE_LOOPS_PER_MS; i++) {
+            if (!player.updateActuator()) continue;
+            actuator.tempLimiting = (nativeMillis >= SAMPLE_LIMITING_START && nativeMillis < SAMPLE_LIMITING_END);
+            ReplayRecord r = sentRecord(player.getFrameState());
+            r.tempLimiting = actuator.tempLimiting;
+            log.push_back(r);
+        }
+    }
+    return log;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_replay_sample()
+{
+    if (getenv("UPDATE_GOLDEN")) {
+        TEST_ASSERT_TRUE(writeReplay(SAMPLE_LOG, recordSample()));
+    }
+    ReplayLog log;
+    TEST_ASSERT_TRUE_MESSAGE(loadReplay(SAMPLE_LOG, log), "missing " SAMPLE_LOG);
+
+    TracePlayer player;
+    ReplayLog sent = replayLog(player, SAMPLE_SCRIPT, log);
+    TEST_ASSERT_EQUAL(-1, compareReplay(sent, log));
+
+    // The stall is replayed, and the recorded limiting is what derates the commands
+    TEST_ASSERT_EQUAL(SAMPLE_STALL_END, sent[SAMPLE_STALL_START / TRACE_TICK_MS].ms);
+    TracePlayer noFeedback;
+    TEST_ASSERT_TRUE(compareReplay(replayLog(noFeedback, SAMPLE_SCRIPT, log, false), log) >= 0);
+}
+
+void test_replay_device_log()
+{
+    const char *logPath = getenv("REPLAY_LOG");
+    const char *script = getenv("REPLAY_SCRIPT");
+    if (!logPath || !script) {
+        TEST_IGNORE_MESSAGE("set REPLAY_LOG and REPLAY_SCRIPT to replay a device log");
+    }
+    const char *session = getenv("REPLAY_SESSION");
+    ReplayLog log;
+    TEST_ASSERT_TRUE_MESSAGE(loadReplay(logPath, log, session ? atoi(session) : -1), logPath);
+
+    // Serve the script's directory as the filesystem root
+    std::string dir(script);
+    size_t slash = dir.rfind('/');
+    std::string name = (slash == std::string::npos) ? "/" + dir : dir.substr(slash);
+    dir = (slash == std::string::npos) ? "." : dir.substr(0, slash);
+
+    TracePlayer player;
+    resetVirtualDevice();
+    SPIFFS.setRoot(dir.c_str());
+    ReplayLog sent = replayLog(player, name.c_str(), log);
+    SPIFFS.setRoot(TRACE_CORPUS_DIR);
+
+    long packet = compareReplay(sent, log);
+    if (packet >= 0) {
+        char message[128];
+        snprintf(message, sizeof(message), "packet %ld of %u (%u ms): sent %d/%d, recorded %d/%d",
+            packet, (unsigned)log.size(), (unsigned)(log[min((size_t)packet, log.size() - 1)].ms - log[0].ms),
+            packet < (long)sent.size() ? sent[packet].positionCommand : 0,
+            packet < (long)sent.size() ? sent[packet].forceCommand : 0,
+            packet < (long)log.size() ? log[packet].positionCommand : 0,
+            packet < (long)log.size() ? log[packet].forceCommand : 0);
+        TEST_FAIL_MESSAGE(message);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_replay_sample);
+    RUN_TEST(test_replay_device_log);
+    return UNITY_END();
+}
@@ -0,0 +1,149 @@
+#define THERMAL_SIM
+#include <unity.h>
+#include "PlayerTrace.h"
+
+/**
+ * Thermal derating against the simulated thermal model, over 10 minutes of
+ * full strokes at full force, looping heavy.funscript, and from a calm
+ * section into a heavy one.
+ */
+
+#define HEAVY_FILE "/heavy.funscript"
+#define CALM_FILE "/calm.funscript"
+#define HEAVY_MS 600000 // virtual ms played
+#define SECTION_TICKS 100 // packets of travel summed to tell calm strokes from heavy ones
+
+/**
+ * The budget is only learned by limiting, so derating can't avoid it, only
+ * keep it short. The first trip learns the budget (about 30 s). After each
+ * trip the budget recovers at THERMAL_BUDGET_RECOVERY (0.06 a minute) from
+ * where it was cut to past the sustainable demand, over 3 minutes, before it
+ * trips again (about 17 s). That is at most four trips in 10 minutes, 81 s
+ * or 13.5% of the time.
+ */
+#define HEAVY_MAX_LIMITED 0.15
+
+typedef NimbleFunscriptPlayer<32, LinearInterpolation, NoVibration, DeltaLimiter<>, fs::FS, SimulatedThermal<> > DeratedPlayer;
+typedef NimbleFunscriptPlayer<32, LinearInterpolation, NoVibration, DeltaLimiter<>, fs::FS, SimulatedThermal<NoDerating> > UnderatedPlayer;
+
+// ThermalDerating without the demand predicted from the buffered keyframes
+class ReactiveDerating : public ThermalDerating {
+    public:
+        void predict(float demand) {}
+};
+typedef NimbleFunscriptPlayer<32, LinearInterpolation, NoVibration, DeltaLimiter<>, fs::FS, SimulatedThermal<ReactiveDerating> > ReactivePlayer;
+
+const char *loopHeavy()
+{
+    return HEAVY_FILE;
+}
+
+int playlistIndex = 0;
+
+const char *calmThenHeavy()
+{
+    static const char *playlist[] = { CALM_FILE, HEAVY_FILE };
+    return (playlistIndex < 2) ? playlist[playlistIndex++] : NULL;
+}
+
+struct ThermalRun {
+    float limited; // fraction of packets sent while limiting
+    unsigned long strokeSum; // total commanded travel
+};
+
+template <class Player>
+ThermalRun runHeavy()
+{
+    Player player;
+    resetVirtualDevice();
+    player.setNextFileHandler(loopHeavy);
+    player.initFunscriptFile(SPIFFS, HEAVY_FILE);
+    player.start();
+
+    unsigned long ticks = 0, limitedTicks = 0, strokeSum = 0;
+    int16_t lastPos = 0;
+    for (; nativeMillis < HEAVY_MS; nativeMillis++) {
+        if (nativeMillis % TRACE_TICK_MS == 0) onTimer();
+        if (!player.updateActuator()) continue;
+        ticks++;
+        if (player.getThermal().isLimiting()) limitedTicks++;
+        strokeSum += abs(actuator.positionCommand - lastPos);
+        lastPos = actuator.positionCommand;
+    }
+    ThermalRun run = { (float)limitedTicks / ticks, strokeSum };
+    return run;
+}
+
+/**
+ * Force commanded on the first heavy stroke after a calm minute, with the
+ * budget learned in a heavy minute before it.
+ */
+template <class Player>
+long forceEnteringHeavy()
+{
+    Player player;
+    resetVirtualDevice();
+    playlistIndex = 0;
+    player.setNextFileHandler(calmThenHeavy);
+    player.initFunscriptFile(SPIFFS, HEAVY_FILE);
+    player.start();
+
+    bool heavy = false;
+    int sections = 0; // still at the start, heavy, calm, then heavy again
+    long travel = 0;
+    unsigned long ticks = 0;
+    int16_t lastPos = 0;
+    for (; nativeMillis < HEAVY_MS; nativeMillis++) {
+        if (nativeMillis % TRACE_TICK_MS == 0) onTimer();
+        if (!player.updateActuator()) continue;
+        travel += abs(actuator.positionCommand - lastPos);
+        lastPos = actuator.positionCommand;
+        if (++ticks % SECTION_TICKS) continue;
+
+        // Calm strokes average 2 per packet, heavy ones 25 (12 derated to the minimum)
+        if (heavy != (travel > SECTION_TICKS * MAX_POSITION_DELTA / 8)) {
+            heavy = !heavy;
+            if (++sections == 3) return actuator.forceCommand;
+        }
+        travel = 0;
+    }
+    return -1;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_heavy_limits_without_derating()
+{
+    ThermalRun run = runHeavy<UnderatedPlayer>();
+    printf("no derating: limited %.1f%% of the time\n", run.limited * 100);
+    TEST_ASSERT_TRUE(run.limited > 0.5);
+}
+
+void test_derating_keeps_below_limit()
+{
+    ThermalRun underated = runHeavy<UnderatedPlayer>();
+    ThermalRun derated = runHeavy<DeratedPlayer>();
+    float motion = (float)derated.strokeSum / underated.strokeSum;
+    printf("derating: limited %.1f%% of the time, %.0f%% of the motion\n", derated.limited * 100, motion * 100);
+    TEST_ASSERT_TRUE(derated.limited < HEAVY_MAX_LIMITED);
+    TEST_ASSERT_TRUE(motion >= THERMAL_DERATE_MIN);
+}
+
+void test_derating_ahead_of_heavy_section()
+{
+    long reactive = forceEnteringHeavy<ReactivePlayer>();
+    long predictive = forceEnteringHeavy<DeratedPlayer>();
+    printf("force entering a heavy section: %ld reactive, %ld predicted\n", reactive, predictive);
+    TEST_ASSERT_TRUE(reactive > 0);
+    TEST_ASSERT_TRUE(predictive < reactive);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_heavy_limits_without_derating);
+    RUN_TEST(test_derating_keeps_below_limit);
+    RUN_TEST(test_derating_ahead_of_heavy_section);
+    return UNITY_END();
+}
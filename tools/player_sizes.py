@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+"""
+Report code size per NimbleFunscriptPlayer instantiation in a compiled program.
+
+Sums the sizes of all functions whose name contains the instantiation's
+template arguments, e.g. its member functions and the benchmark's tick().
+Build the benchmark first with the native env:
+
+Usage:
+    pio test -e native -f test_benchmark
+    python3 tools/player_sizes.py .pio/build/native/program
+"""
+import argparse
+import collections
+import subprocess
+
+PLAYER = "NimbleFunscriptPlayer<"
+
+
+def template_args(name, start):
+    """Return the bracketed template arguments starting at name[start] == '<'."""
+    depth = 0
+    for i in range(start, len(name)):
+        if name[i] == "<":
+            depth += 1
+        elif name[i] == ">":
+            depth -= 1
+            if depth == 0:
+                return name[start:i + 1]
+    return name[start:]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("program", nargs="?", default=".pio/build/native/program", help="compiled program")
+    parser.add_argument("--nm", default="nm", help="nm tool (e.g. xtensa-esp32-elf-nm for firmware.elf)")
+    args = parser.parse_args()
+
+    out = subprocess.run([args.nm, "-C", "-S", "--size-sort", args.program],
+                         check=True, capture_output=True, text=True).stdout
+    sizes = collections.Counter()
+    counts = collections.Counter()
+    for line in out.splitlines():
+        parts = line.split(None, 3)
+        if len(parts) < 4 or parts[2] not in "tTwW":
+            continue
+        name = parts[3]
+        i = name.find(PLAYER)
+        if i < 0:
+            continue
+        player = template_args(name, i + len(PLAYER) - 1)
+        sizes[player] += int(parts[1], 16)
+        counts[player] += 1
+
+    if not sizes:
+        raise SystemExit("no NimbleFunscriptPlayer functions found in " + args.program)
+    print("%8s %5s  %s" % ("bytes", "funcs", "instantiation"))
+    for player, size in sorted(sizes.items(), key=lambda kv: kv[1]):
+        print("%8d %5d  %s" % (size, counts[player], player))
+
+
+if __name__ == "__main__":
+    main()
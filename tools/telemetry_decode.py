@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+"""
+Decode a telemetry log recorded by TelemetryRecorder (build env "telemetry").
+
+Input is either a raw log file (/telemetry.bin, /telemetry.old) or a serial
+monitor capture of the "d" dump command. Prints the records as CSV, or with
+--funscript writes the commanded positions as a funscript that can be uploaded
+and replayed on the device.
+
+Segments are decoded in file order and never sorted by time: millis() restarts
+on each boot, so the previous boot's log in /telemetry.old overlaps the current
+one. Each record is tagged with its segment and session (one session per boot).
+
+Usage:
+    python3 tools/telemetry_decode.py monitor.log > session.csv
+    python3 tools/telemetry_decode.py telemetry.bin --funscript replay.funscript
+    python3 tools/telemetry_decode.py monitor.log --session 0 --funscript replay.funscript
+"""
+import argparse
+import json
+import struct
+import sys
+
+MAGIC = 0x4C54464E
+VERSION = 2
+HEADER = struct.Struct("<IHHI")
+RECORD = struct.Struct("<I7hbB")
+FIELDS = [
+    "ms", "targetPos", "position", "vibrationPos", "positionCommand",
+    "forceCommand", "positionFeedback", "forceFeedback", "air", "flags",
+]
+FLAGS = [
+    (0x01, "airIn"),
+    (0x02, "airOut"),
+    (0x04, "tempLimiting"),
+    (0x08, "sensorFault"),
+    (0x10, "present"),
+]
+ACTUATOR_MAX_POS = 750
+LATE_MS = 4  # packets are sent every 2 ms
+PAUSE_MS = 1000  # longer gaps are playback pauses, nothing is recorded then
+
+
+def read_segments(path):
+    """Return the raw log segments contained in a log file or monitor capture."""
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:4] == struct.pack("<I", MAGIC):
+        return [data]
+
+    segments = []
+    current = None
+    for line in data.decode("utf-8", "replace").splitlines():
+        line = line.strip()
+        # The monitor "time" filter prefixes each line with a timestamp
+        if " > " in line:
+            line = line.split(" > ", 1)[1].strip()
+        if line.startswith("-- file "):
+            current = bytearray()
+            segments.append(current)
+        elif line.startswith("-- telemetry end"):
+            current = None
+        elif current is not None and line:
+            current.extend(bytes.fromhex(line))
+    return [bytes(s) for s in segments]
+
+
+def decode(segment):
+    """Return the boot id and records of a log segment."""
+    magic, version, record_size, boot_id = HEADER.unpack_from(segment, 0)
+    if magic != MAGIC:
+        raise ValueError("not a telemetry log")
+    if version != VERSION or record_size != RECORD.size:
+        raise ValueError("unsupported log version %d (record size %d)" % (version, record_size))
+    end = len(segment) - (len(segment) - HEADER.size) % RECORD.size
+    records = [dict(zip(FIELDS, RECORD.unpack_from(segment, offset))) for offset in range(HEADER.size, end, RECORD.size)]
+    return boot_id, records
+
+
+def decode_sessions(segments):
+    """Tag records with their segment and session, keeping file order.
+    Consecutive segments from the same boot are one session."""
+    records = []
+    session = -1
+    last_boot = None
+    for index, segment in enumerate(segments):
+        boot_id, segment_records = decode(segment)
+        if boot_id != last_boot:
+            session += 1
+            last_boot = boot_id
+        for r in segment_records:
+            r["segment"] = index
+            r["session"] = session
+            records.append(r)
+    return records
+
+
+def report_gaps(records, out):
+    """Summarize the gaps between consecutive records of each segment, which
+    show how long the control loop stalled (e.g. on flash writes)."""
+    late = 0
+    max_gap = 0
+    for prev, r in zip(records, records[1:]):
+        if r["segment"] != prev["segment"]:
+            continue
+        gap = r["ms"] - prev["ms"]
+        if LATE_MS < gap < PAUSE_MS:
+            late += 1
+            max_gap = max(max_gap, gap)
+    out.write("%d records, %d late (gap over %d ms), max gap %d ms\n" % (len(records), late, LATE_MS, max_gap))
+
+
+def write_csv(records, out):
+    out.write(",".join(["session", "segment"] + FIELDS[:-1] + [name for _, name in FLAGS]) + "\n")
+    for r in records:
+        flags = [str(int(bool(r["flags"] & bit))) for bit, _ in FLAGS]
+        out.write(",".join([str(r["session"]), str(r["segment"])] + [str(r[k]) for k in FIELDS[:-1]] + flags) + "\n")
+
+
+def write_funscript(records, out, interval):
+    actions = []
+    start = None
+    for r in records:
+        if start is None:
+            start = r["ms"]
+        at = r["ms"] - start
+        if actions and at - actions[-1]["at"] < interval:
+            continue
+        pos = round((r["positionCommand"] + ACTUATOR_MAX_POS) * 100 / (2 * ACTUATOR_MAX_POS))
+        actions.append({"at": at, "pos": max(0, min(100, pos))})
+    json.dump({"actions": actions}, out, separators=(",", ":"))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("log", help="raw log file or serial monitor capture")
+    parser.add_argument("--funscript", metavar="PATH", help="write commanded positions as a funscript")
+    parser.add_argument("--interval", type=int, default=20, help="funscript action interval in ms (default 20)")
+    parser.add_argument("--session", type=int, help="only this session (default: all for CSV, the last one for --funscript)")
+    args = parser.parse_args()
+
+    records = decode_sessions(read_segments(args.log))
+    if args.session is None and args.funscript and records:
+        args.session = records[-1]["session"]
+    if args.session is not None:
+        records = [r for r in records if r["session"] == args.session]
+    if not records:
+        sys.exit("no telemetry records found")
+    report_gaps(records, sys.stderr)
+
+    if args.funscript:
+        with open(args.funscript, "w") as out:
+            write_funscript(records, out, args.interval)
+    else:
+        write_csv(records, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()